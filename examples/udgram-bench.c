@@ -0,0 +1,139 @@
+/*
+ * udgram-bench.c - loopback UDP throughput with batched datagram I/O
+ *
+ * Usage: udgram-bench [-b batch] [-g segment] [-s size] [-t seconds]
+ *   -b: messages per syscall, 1 gives one syscall per packet
+ *   -g: send with GSO in chunks of this many segments and receive with GRO
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "udgram.h"
+#include "usock.h"
+
+static struct udgram rx, tx;
+static struct uloop_defer send_defer;
+static struct uloop_timeout done_timer;
+static unsigned long long received;
+static int msg_size = 64, gso_segs;
+static char msg[UINT16_MAX];
+
+static void recv_cb(struct udgram *u, struct udgram_pkt *pkts, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (pkts[i].segment_size)
+			received += (pkts[i].len + pkts[i].segment_size - 1) /
+				    pkts[i].segment_size;
+		else
+			received++;
+	}
+}
+
+static void send_cb(struct uloop_defer *d)
+{
+	int i;
+
+	if (gso_segs) {
+		udgram_send_gso(&tx, msg, gso_segs * msg_size, msg_size, NULL, 0);
+	} else {
+		for (i = 0; i < tx.batch_size; i++)
+			if (udgram_send(&tx, msg, msg_size, NULL, 0))
+				break;
+	}
+
+	uloop_defer_add(d);
+}
+
+static void done_cb(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+int main(int argc, char **argv)
+{
+	const char *port = "17342";
+	int ch, secs = 5, batch = 32;
+
+	while ((ch = getopt(argc, argv, "b:g:s:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'g':
+			gso_segs = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (batch <= 0 || secs <= 0 || msg_size <= 0 || gso_segs < 0 ||
+	    (gso_segs ? gso_segs : 1) * msg_size > (int) sizeof(msg))
+		return 1;
+
+	uloop_init();
+
+	rx.notify_recv = recv_cb;
+	rx.batch_size = batch;
+	rx.gro = !!gso_segs;
+	if (udgram_init(&rx, usock(USOCK_UDP | USOCK_SERVER | USOCK_NONBLOCK |
+				   USOCK_NUMERIC, "127.0.0.1", port))) {
+		perror("receiver");
+		return 1;
+	}
+
+	tx.batch_size = batch;
+	if (udgram_init(&tx, usock(USOCK_UDP | USOCK_NONBLOCK | USOCK_NUMERIC,
+				   "127.0.0.1", port))) {
+		perror("sender");
+		return 1;
+	}
+
+	send_defer.cb = send_cb;
+	uloop_defer_add(&send_defer);
+
+	done_timer.cb = done_cb;
+	uloop_timeout_set(&done_timer, secs * 1000);
+	uloop_run();
+
+	fprintf(stderr, "batch %d, %d byte messages%s: %llu received (%.0f/s)\n",
+		batch, msg_size, rx.gro ? ", gso/gro" : "",
+		received, (double) received / secs);
+	fprintf(stderr, "rx: %llu syscalls, tx: %llu packets in %llu syscalls, %llu dropped\n",
+		(unsigned long long) rx.stats.rx_syscalls,
+		(unsigned long long) tx.stats.tx_packets,
+		(unsigned long long) tx.stats.tx_syscalls,
+		(unsigned long long) tx.stats.tx_dropped);
+
+	uloop_defer_cancel(&send_defer);
+	udgram_free(&rx);
+	udgram_free(&tx);
+	close(rx.fd.fd);
+	close(tx.fd.fd);
+	uloop_done();
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * uloop-echo-bench.c - loopback TCP echo throughput of the uloop backend
+ *
+ * Build once with the default epoll backend and once with -DUSE_IO_URING=ON
+ * to compare them. Usage: uloop-echo-bench [-b] [-e] [connections [seconds]]
+ *   -b: dispatch events in batches (uloop_batch_events)
+ *   -e: register the connections edge triggered
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uloop.h"
+#include "usock.h"
+
+#define DEFAULT_CONNS	1000
+#define DEFAULT_TIME	5
+#define MSG_SIZE	64
+
+struct conn {
+	struct uloop_fd fd;
+	bool client;
+};
+
+static struct uloop_fd server;
+static struct uloop_timeout done_timer;
+static struct conn *conns;
+static int n_conns, n_accepted;
+static unsigned int conn_flags = ULOOP_READ;
+static unsigned long long msgs;
+static char msg[MSG_SIZE];
+
+static void conn_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct conn *c = container_of(fd, struct conn, fd);
+	char buf[MSG_SIZE * 4];
+	int len;
+
+	while (1) {
+		len = read(fd->fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len <= 0)
+			break;
+
+		if (c->client)
+			msgs += len / MSG_SIZE;
+
+		if (write(fd->fd, buf, len) < 0)
+			break;
+	}
+
+	if (fd->eof || fd->error) {
+		uloop_fd_delete(fd);
+		close(fd->fd);
+	}
+}
+
+static void set_nonblock(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void server_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct conn *c;
+	int sfd;
+
+	while (n_accepted < n_conns) {
+		sfd = accept(fd->fd, NULL, NULL);
+		if (sfd < 0)
+			break;
+
+		c = &conns[n_conns + n_accepted++];
+		c->fd.fd = sfd;
+		c->fd.cb = conn_cb;
+		set_nonblock(sfd);
+		uloop_fd_add(&c->fd, conn_flags);
+	}
+}
+
+static void done_cb(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+static void raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+int main(int argc, char **argv)
+{
+	const char *port = "17341";
+	int i, ch, secs = DEFAULT_TIME;
+
+	while ((ch = getopt(argc, argv, "be")) != -1) {
+		switch (ch) {
+		case 'b':
+			uloop_batch_events = true;
+			break;
+		case 'e':
+			conn_flags |= ULOOP_EDGE_TRIGGER;
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	n_conns = DEFAULT_CONNS;
+	if (argc > 0)
+		n_conns = atoi(argv[0]);
+	if (argc > 1)
+		secs = atoi(argv[1]);
+
+	if (n_conns <= 0 || secs <= 0)
+		return 1;
+
+	raise_nofile();
+
+	conns = calloc(2 * n_conns, sizeof(*conns));
+	if (!conns)
+		return 1;
+
+	uloop_init();
+
+	server.fd = usock(USOCK_TCP | USOCK_SERVER | USOCK_NONBLOCK | USOCK_NUMERIC,
+			  "127.0.0.1", port);
+	if (server.fd < 0) {
+		perror("usock");
+		return 1;
+	}
+	server.cb = server_cb;
+	uloop_fd_add(&server, ULOOP_READ);
+
+	for (i = 0; i < n_conns; i++) {
+		struct conn *c = &conns[i];
+
+		c->client = true;
+		c->fd.cb = conn_cb;
+		c->fd.fd = usock(USOCK_TCP | USOCK_NUMERIC, "127.0.0.1", port);
+		if (c->fd.fd < 0) {
+			perror("connect");
+			return 1;
+		}
+
+		set_nonblock(c->fd.fd);
+		uloop_fd_add(&c->fd, conn_flags);
+		if (write(c->fd.fd, msg, sizeof(msg)) < 0) {
+			perror("write");
+			return 1;
+		}
+	}
+
+	done_timer.cb = done_cb;
+	uloop_timeout_set(&done_timer, secs * 1000);
+	uloop_run();
+
+	fprintf(stderr, "%d connections: %llu round trips in %d s (%.0f/s)\n",
+		n_conns, msgs, secs, (double) msgs / secs);
+
+	for (i = 0; i < n_conns + n_accepted; i++) {
+		uloop_fd_delete(&conns[i].fd);
+		close(conns[i].fd.fd);
+	}
+	uloop_fd_delete(&server);
+	close(server.fd);
+	uloop_done();
+	free(conns);
+
+	return 0;
+}
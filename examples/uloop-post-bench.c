@@ -0,0 +1,106 @@
+/*
+ * uloop-post-bench.c - throughput of uloop_post() with several producer
+ * threads
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "uloop.h"
+
+#define DEFAULT_POSTS	1000000
+#define MAX_THREADS	16
+
+static struct uloop_ctx *ctx;
+static unsigned long received, total;
+static int per_thread;
+
+static void post_cb(void *arg)
+{
+	if (++received == total)
+		uloop_end();
+}
+
+static void *producer(void *arg)
+{
+	int i;
+
+	for (i = 0; i < per_thread; i++)
+		while (uloop_post(ctx, post_cb, NULL))
+			;
+
+	return NULL;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) +
+	       (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void run(int threads, int posts)
+{
+	pthread_t tid[MAX_THREADS];
+	const struct uloop_stats *stats = uloop_get_stats();
+	uint64_t wakeups = stats->wakeups;
+	struct timespec start;
+	double t;
+	int i;
+
+	per_thread = posts / threads;
+	total = (unsigned long) per_thread * threads;
+	received = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; i++)
+		pthread_create(&tid[i], NULL, producer, NULL);
+
+	uloop_run();
+	t = elapsed(&start);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+
+	fprintf(stderr, "%2d producers: %lu posts in %.3f s (%.0f/s), %llu wakeups\n",
+		threads, total, t, total / t,
+		(unsigned long long) (stats->wakeups - wakeups));
+}
+
+int main(int argc, char **argv)
+{
+	int posts = DEFAULT_POSTS;
+	int i;
+
+	if (argc > 1)
+		posts = atoi(argv[1]);
+
+	if (posts < MAX_THREADS)
+		return 1;
+
+	uloop_init();
+	ctx = uloop_ctx_current();
+
+	for (i = 1; i <= MAX_THREADS; i *= 2)
+		run(i, posts);
+
+	uloop_done();
+
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * uloop-process-bench.c - spawn and reap a large number of child processes
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "uloop.h"
+
+#define DEFAULT_CHILDREN	10000
+#define MAX_RUNNING		64
+
+static struct uloop_process *procs;
+static int total, started, reaped, failed;
+
+static void proc_start(struct uloop_process *p);
+
+static void proc_done(struct uloop_process *p, int ret)
+{
+	reaped++;
+	if (!WIFEXITED(ret) || WEXITSTATUS(ret) != 0)
+		failed++;
+
+	if (started < total)
+		proc_start(&procs[started]);
+	else if (reaped == total)
+		uloop_end();
+}
+
+static void proc_start(struct uloop_process *p)
+{
+	pid_t pid;
+
+	started++;
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+
+	if (!pid)
+		_exit(0);
+
+	p->pid = pid;
+	p->cb = proc_done;
+	uloop_process_add(p);
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	double t;
+	int i;
+
+	total = DEFAULT_CHILDREN;
+	if (argc > 1)
+		total = atoi(argv[1]);
+
+	if (total <= 0)
+		return 1;
+
+	procs = calloc(total, sizeof(*procs));
+	if (!procs)
+		return 1;
+
+	uloop_init();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < total && i < MAX_RUNNING; i++)
+		proc_start(&procs[i]);
+
+	uloop_run();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "spawned and reaped %d children in %.3f s (%.0f/s), %d failed\n",
+		reaped, t, reaped / t, failed);
+
+	uloop_done();
+	free(procs);
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * uloop-timeout-bench.c - compare timer arming cost of a sorted list
+ * against the uloop timer wheel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "uloop.h"
+
+#define DEFAULT_TIMERS	100000
+#define MAX_DELAY	60000
+
+static LIST_HEAD(list_timeouts);
+
+static int64_t ts_diff(struct timespec *t1, struct timespec *t2)
+{
+	return
+		(int64_t) (t1->tv_sec - t2->tv_sec) * 1000000000 +
+		(t1->tv_nsec - t2->tv_nsec);
+}
+
+/* the sorted list insertion uloop used before the timer wheel */
+static void list_timeout_add(struct uloop_timeout *timeout)
+{
+	struct uloop_timeout *tmp;
+	struct list_head *h = &list_timeouts;
+
+	list_for_each_entry(tmp, &list_timeouts, list) {
+		if (ts_diff(&tmp->deadline, &timeout->deadline) > 0) {
+			h = &tmp->list;
+			break;
+		}
+	}
+
+	list_add_tail(&timeout->list, h);
+}
+
+static void list_timeout_set(struct uloop_timeout *timeout, int msecs)
+{
+	struct timespec *time = &timeout->deadline;
+
+	if (timeout->pending)
+		list_del(&timeout->list);
+
+	clock_gettime(CLOCK_MONOTONIC, time);
+	time->tv_sec += msecs / 1000;
+	time->tv_nsec += (msecs % 1000) * 1000000;
+	if (time->tv_nsec >= 1000000000) {
+		time->tv_sec++;
+		time->tv_nsec -= 1000000000;
+	}
+
+	list_timeout_add(timeout);
+	timeout->pending = true;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) +
+	       (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double run(const char *name, struct uloop_timeout *t, int *delay, int n, bool wheel)
+{
+	struct timespec start;
+	double ret;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		if (wheel)
+			uloop_timeout_set(&t[i], delay[i]);
+		else
+			list_timeout_set(&t[i], delay[i]);
+	}
+	ret = elapsed(&start);
+
+	fprintf(stderr, "%-6s: armed %d timers in %.3f s (%.1f ns/timer)\n",
+		name, n, ret, ret * 1e9 / n);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct uloop_timeout *t;
+	double t_list, t_wheel;
+	int *delay;
+	int i, n = DEFAULT_TIMERS;
+
+	if (argc > 1)
+		n = atoi(argv[1]);
+
+	if (n <= 0)
+		return 1;
+
+	t = calloc(n, sizeof(*t));
+	delay = calloc(n, sizeof(*delay));
+	if (!t || !delay)
+		return 1;
+
+	srand(1);
+	for (i = 0; i < n; i++)
+		delay[i] = rand() % MAX_DELAY;
+
+	t_list = run("list", t, delay, n, false);
+	for (i = 0; i < n; i++)
+		t[i].pending = false;
+
+	t_wheel = run("wheel", t, delay, n, true);
+	for (i = 0; i < n; i++)
+		uloop_timeout_cancel(&t[i]);
+
+	if (t_wheel > 0)
+		fprintf(stderr, "speedup: %.1fx\n", t_list / t_wheel);
+
+	free(delay);
+	free(t);
+
+	return 0;
+}
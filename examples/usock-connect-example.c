@@ -0,0 +1,204 @@
+/*
+ * usock-connect-example.c - happy eyeballs connects on loopback
+ *
+ * Runs usock_async_connect_addrinfo() against hand-made candidate lists,
+ * with an AF_UNIX entry mixed in that must be skipped: a refused address
+ * followed by a working one, a stalled address (a
+ * listener with a full backlog drops the SYN) followed by one of the other
+ * family, and a stalled address alone with a connect timeout.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ustream.h"
+#include "usock.h"
+
+#define N_STALL		8
+
+struct candidate {
+	struct addrinfo ai;
+	struct sockaddr_storage addr;
+};
+
+static struct usock_async_connect conn;
+static struct ustream_fd stream;
+static struct timespec start;
+static int result, elapsed;
+
+static int msecs_since(struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - ts->tv_sec) * 1000 +
+	       (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+static void connect_cb(struct usock_async_connect *c, int error)
+{
+	result = error;
+	elapsed = msecs_since(&start);
+	uloop_end();
+}
+
+static int listener(int family, int backlog, int *port)
+{
+	struct sockaddr_storage ss = { .ss_family = family };
+	socklen_t len = sizeof(ss);
+	int fd;
+
+	fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0 ||
+	    bind(fd, (struct sockaddr *) &ss, family == AF_INET ?
+		 sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)) ||
+	    listen(fd, backlog) ||
+	    getsockname(fd, (struct sockaddr *) &ss, &len))
+		return -1;
+
+	*port = family == AF_INET ? ((struct sockaddr_in *) &ss)->sin_port :
+				    ((struct sockaddr_in6 *) &ss)->sin6_port;
+	return fd;
+}
+
+static void set_candidate(struct candidate *c, int family, int port)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *) &c->addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &c->addr;
+	struct sockaddr_un *sun = (struct sockaddr_un *) &c->addr;
+
+	memset(c, 0, sizeof(*c));
+	c->ai.ai_family = family;
+	c->ai.ai_socktype = SOCK_STREAM;
+	c->ai.ai_addr = (struct sockaddr *) &c->addr;
+
+	switch (family) {
+	case AF_INET:
+		sin->sin_family = AF_INET;
+		sin->sin_port = port;
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		c->ai.ai_addrlen = sizeof(*sin);
+		break;
+	case AF_INET6:
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = port;
+		sin6->sin6_addr = in6addr_loopback;
+		c->ai.ai_addrlen = sizeof(*sin6);
+		break;
+	default:
+		/* not a candidate, must be skipped */
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, "/nonexistent");
+		c->ai.ai_addrlen = sizeof(*sun);
+		break;
+	}
+}
+
+static int run(const char *name, struct candidate *list, int n, int timeout,
+	       int expect_error, int expect_family)
+{
+	int i, family = 0;
+
+	for (i = 0; i < n - 1; i++)
+		list[i].ai.ai_next = &list[i + 1].ai;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.cb = connect_cb;
+	conn.stream = &stream;
+	conn.timeout_msecs = timeout;
+	result = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (usock_async_connect_addrinfo(&conn, USOCK_TCP, &list[0].ai)) {
+		fprintf(stderr, "%s: failed to start: %s\n", name, strerror(errno));
+		return 1;
+	}
+
+	if (result < 0)
+		uloop_run();
+
+	if (!result) {
+		family = conn.addr.ss_family;
+		ustream_free(&stream.stream);
+		close(stream.fd.fd);
+	}
+
+	fprintf(stderr, "%s: %s after %d ms%s\n", name,
+		result ? strerror(result) : "connected", elapsed,
+		!result ? (family == AF_INET6 ? " (IPv6)" : " (IPv4)") : "");
+
+	return result != expect_error || (!result && family != expect_family);
+}
+
+int main(int argc, char **argv)
+{
+	struct candidate list[3];
+	int stall[N_STALL];
+	int good4, good6, stalled, refused;
+	int port4, port6, stall_port, refused_port;
+	int i, ret = 0;
+
+	uloop_init();
+
+	good4 = listener(AF_INET, 16, &port4);
+	good6 = listener(AF_INET6, 16, &port6);
+	refused = listener(AF_INET6, 16, &refused_port);
+	stalled = listener(AF_INET, 0, &stall_port);
+	if (good4 < 0 || good6 < 0 || refused < 0 || stalled < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	/* nothing listens on this port any more */
+	close(refused);
+
+	/* fill the backlog of the stalled listener, further SYNs are dropped */
+	set_candidate(&list[0], AF_INET, stall_port);
+	for (i = 0; i < N_STALL; i++) {
+		stall[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		connect(stall[i], list[0].ai.ai_addr, list[0].ai.ai_addrlen);
+	}
+
+	set_candidate(&list[0], AF_UNIX, 0);
+	set_candidate(&list[1], AF_INET6, refused_port);
+	set_candidate(&list[2], AF_INET, port4);
+	ret |= run("refused, then IPv4", list, 3, 0, 0, AF_INET);
+
+	set_candidate(&list[0], AF_INET, stall_port);
+	set_candidate(&list[1], AF_UNIX, 0);
+	set_candidate(&list[2], AF_INET6, port6);
+	ret |= run("stalled IPv4, then IPv6", list, 3, 0, 0, AF_INET6);
+
+	set_candidate(&list[0], AF_INET, stall_port);
+	ret |= run("stalled only, 300 ms timeout", list, 1, 300, ETIMEDOUT, 0);
+
+	for (i = 0; i < N_STALL; i++)
+		close(stall[i]);
+	close(stalled);
+	close(good4);
+	close(good6);
+	uloop_done();
+
+	return ret;
+}
@@ -0,0 +1,155 @@
+/*
+ * usock-resolve-example.c - usock_resolve cache behaviour with a stub
+ * resolver
+ *
+ * The stub answers every name with 127.0.0.1 and a 2 second ttl. Names
+ * starting with "slow" take 300 ms to resolve. The example checks a
+ * cache miss, a hit, expiry after the ttl, cancelling a running lookup,
+ * and a connect timing out while its lookup is still running. In the
+ * last two cases the requests are freed before the lookups complete.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+#include "usock.h"
+
+#define STUB_TTL	2
+
+static int lookups, callbacks, failed;
+static struct uloop_timeout wait_timer;
+
+static int stub_resolver(const char *host, const char *service,
+			 const struct addrinfo *hints,
+			 struct addrinfo **result, unsigned int *ttl)
+{
+	struct addrinfo h = *hints;
+
+	__atomic_add_fetch(&lookups, 1, __ATOMIC_RELAXED);
+	if (host && !strncmp(host, "slow", 4))
+		usleep(300 * 1000);
+
+	*ttl = STUB_TTL;
+	h.ai_flags |= AI_NUMERICHOST;
+	return getaddrinfo("127.0.0.1", service, &h, result);
+}
+
+static void check(const char *name, bool ok)
+{
+	fprintf(stderr, "%-40s %s\n", name, ok ? "ok" : "FAILED");
+	if (!ok)
+		failed++;
+}
+
+static void resolve_cb(struct usock_resolve *r, struct addrinfo *result, int error)
+{
+	callbacks++;
+	if (error || !result)
+		failed++;
+	uloop_end();
+}
+
+static void wait_cb(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+static void wait_msecs(int msecs)
+{
+	wait_timer.cb = wait_cb;
+	uloop_timeout_set(&wait_timer, msecs);
+	uloop_run();
+}
+
+static void resolve(struct usock_resolve *r, const char *host)
+{
+	memset(r, 0, sizeof(*r));
+	r->cb = resolve_cb;
+	if (usock_resolve(r, USOCK_TCP, host, "80")) {
+		failed++;
+		return;
+	}
+
+	uloop_run();
+}
+
+static void connect_cb(struct usock_async_connect *c, int error)
+{
+	callbacks++;
+	if (error != ETIMEDOUT)
+		failed++;
+
+	/* the lookup is still running, c must not be touched by it */
+	memset(c, 0x55, sizeof(*c));
+	free(c);
+	uloop_end();
+}
+
+int main(int argc, char **argv)
+{
+	struct usock_resolve_stats stats;
+	struct usock_resolve r, *rp;
+	struct usock_async_connect *c;
+	struct ustream_fd stream;
+
+	usock_resolver = stub_resolver;
+	uloop_init();
+
+	resolve(&r, "example.org");
+	usock_resolve_get_stats(&stats);
+	check("first lookup misses", lookups == 1 && stats.misses == 1);
+
+	resolve(&r, "example.org");
+	usock_resolve_get_stats(&stats);
+	check("second lookup hits the cache", lookups == 1 && stats.hits == 1);
+
+	wait_msecs((STUB_TTL + 1) * 1000);
+	resolve(&r, "example.org");
+	check("lookup after the ttl misses", lookups == 2);
+
+	callbacks = 0;
+	rp = calloc(1, sizeof(*rp));
+	rp->cb = resolve_cb;
+	usock_resolve(rp, USOCK_TCP, "slow.example.org", "80");
+	wait_msecs(50);
+	check("cancel while running", usock_resolve_cancel(rp) == 0);
+	memset(rp, 0x55, sizeof(*rp));
+	free(rp);
+	wait_msecs(500);
+	usock_resolve_get_stats(&stats);
+	check("cancelled lookup does not call back", !callbacks);
+	check("cancelled lookup fills the cache", stats.entries == 2);
+
+	c = calloc(1, sizeof(*c));
+	c->cb = connect_cb;
+	c->stream = &stream;
+	c->timeout_msecs = 50;
+	usock_async_connect(c, USOCK_TCP, "slow2.example.org", "80");
+	uloop_run();
+	wait_msecs(500);
+	check("connect times out during the lookup", callbacks == 1);
+
+	usock_resolve_flush();
+	uloop_done();
+
+	return !!failed;
+}
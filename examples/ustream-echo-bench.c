@@ -0,0 +1,185 @@
+/*
+ * ustream-echo-bench.c - echo over ustream_fd pairs, reports the syscalls
+ * spent on fd registration and the buffer pool usage
+ *
+ * Usage: ustream-echo-bench [-a] [-b] [-p] [-n connections] [-s size] [-t seconds]
+ *   -a: adaptive buffer sizes
+ *   -b: batch fd updates until the next poll (uloop_batch_fd_updates)
+ *   -p: disable the ustream buffer pool
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+#include "uloop.h"
+
+struct conn {
+	struct ustream_fd server;
+	struct ustream_fd client;
+	int pending;
+};
+
+static struct uloop_timeout done_timer;
+static unsigned long long msgs;
+static char *msg;
+static int msg_size = 16384;
+static bool adaptive;
+
+static void server_read_cb(struct ustream *s, int bytes)
+{
+	char *data;
+	int len;
+
+	while ((data = ustream_get_read_buf(s, &len)) != NULL) {
+		len = ustream_write(s, data, len, false);
+		if (!len)
+			break;
+
+		ustream_consume(s, len);
+	}
+}
+
+static void client_send(struct conn *c)
+{
+	ustream_write(&c->client.stream, msg, msg_size, false);
+	c->pending = msg_size;
+}
+
+static void client_read_cb(struct ustream *s, int bytes)
+{
+	struct conn *c = container_of(s, struct conn, client.stream);
+	int len;
+
+	while (ustream_get_read_buf(s, &len)) {
+		ustream_consume(s, len);
+		c->pending -= len;
+	}
+
+	if (c->pending <= 0) {
+		msgs++;
+		client_send(c);
+	}
+}
+
+static void server_write_cb(struct ustream *s, int bytes)
+{
+	/* resume echoing data that could not be written before */
+	server_read_cb(s, 0);
+}
+
+static void done_cb(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+int main(int argc, char **argv)
+{
+	const struct uloop_stats *stats;
+	struct ustream_pool_stats pool;
+	struct conn *conns;
+	int n_conns = 100, secs = 5;
+	int i, ch, sv[2];
+
+	while ((ch = getopt(argc, argv, "abpn:s:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+			adaptive = true;
+			break;
+		case 'b':
+			uloop_batch_fd_updates = true;
+			break;
+		case 'p':
+			ustream_pool_max_bytes = 0;
+			break;
+		case 'n':
+			n_conns = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (n_conns <= 0 || msg_size <= 0 || secs <= 0)
+		return 1;
+
+	msg = calloc(1, msg_size);
+	conns = calloc(n_conns, sizeof(*conns));
+	if (!msg || !conns)
+		return 1;
+
+	uloop_init();
+
+	for (i = 0; i < n_conns; i++) {
+		struct conn *c = &conns[i];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+			perror("socketpair");
+			return 1;
+		}
+
+		c->server.stream.r.adaptive = adaptive;
+		c->server.stream.w.adaptive = adaptive;
+		c->server.stream.notify_read = server_read_cb;
+		c->server.stream.notify_write = server_write_cb;
+		ustream_fd_init(&c->server, sv[0]);
+
+		c->client.stream.r.adaptive = adaptive;
+		c->client.stream.w.adaptive = adaptive;
+		c->client.stream.notify_read = client_read_cb;
+		ustream_fd_init(&c->client, sv[1]);
+
+		client_send(c);
+	}
+
+	done_timer.cb = done_cb;
+	uloop_timeout_set(&done_timer, secs * 1000);
+	uloop_run();
+
+	stats = uloop_get_stats();
+	fprintf(stderr, "%d connections, %d byte messages: %llu round trips in %d s (%.0f/s)\n",
+		n_conns, msg_size, msgs, secs, (double) msgs / secs);
+	fprintf(stderr, "fd registration syscalls: %llu, saved: %llu\n",
+		(unsigned long long) stats->fd_syscalls,
+		(unsigned long long) stats->fd_syscalls_saved);
+
+	ustream_pool_get_stats(&pool);
+	fprintf(stderr, "buffer pool: %llu hits, %llu misses, %llu released, %zu bytes cached\n",
+		(unsigned long long) pool.hits, (unsigned long long) pool.misses,
+		(unsigned long long) pool.released, pool.bytes);
+
+	for (i = 0; i < n_conns; i++) {
+		ustream_free(&conns[i].server.stream);
+		ustream_free(&conns[i].client.stream);
+		close(conns[i].server.fd.fd);
+		close(conns[i].client.fd.fd);
+	}
+	ustream_pool_trim(0);
+	uloop_done();
+	free(conns);
+	free(msg);
+
+	return 0;
+}
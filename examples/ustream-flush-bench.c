@@ -0,0 +1,149 @@
+/*
+ * ustream-flush-bench.c - time spent flushing a write buffer backlog
+ *
+ * Usage: ustream-flush-bench [-v] [-b backlog] [-c chunk] [-r rounds]
+ *   -v: flush one buffer per write() instead of using writev()
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+static struct ustream_fd stream;
+static int (*fd_write)(struct ustream *s, const char *buf, int len, bool more);
+static int (*fd_writev)(struct ustream *s, const struct iovec *iov, int iovcnt);
+static unsigned long long calls;
+
+static int count_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	calls++;
+	return fd_write(s, buf, len, more);
+}
+
+static int count_writev(struct ustream *s, const struct iovec *iov, int iovcnt)
+{
+	calls++;
+	return fd_writev(s, iov, iovcnt);
+}
+
+static void drain(int fd)
+{
+	char buf[65536];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void fill(int fd)
+{
+	char buf[4096] = {};
+
+	while (write(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+int main(int argc, char **argv)
+{
+	struct ustream *s = &stream.stream;
+	struct timespec start, end;
+	int backlog = 65536, chunk = 64, rounds = 1000;
+	unsigned long long flush_calls = 0;
+	double t = 0;
+	char *data;
+	int i, ch, sv[2];
+	bool use_writev = true;
+
+	while ((ch = getopt(argc, argv, "vb:c:r:")) != -1) {
+		switch (ch) {
+		case 'v':
+			use_writev = false;
+			break;
+		case 'b':
+			backlog = atoi(optarg);
+			break;
+		case 'c':
+			chunk = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (backlog <= 0 || chunk <= 0 || rounds <= 0)
+		return 1;
+
+	data = calloc(1, chunk);
+	if (!data)
+		return 1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror("socketpair");
+		return 1;
+	}
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+	uloop_init();
+	ustream_fd_init(&stream, sv[0]);
+
+	fd_write = s->write;
+	fd_writev = s->writev;
+	s->write = count_write;
+	s->writev = use_writev ? count_writev : NULL;
+
+	for (i = 0; i < rounds; i++) {
+		int n;
+
+		/* build up a backlog behind a full socket */
+		fill(sv[0]);
+		for (n = 0; n < backlog; n += chunk)
+			ustream_write(s, data, chunk, true);
+		drain(sv[1]);
+
+		calls = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (!ustream_write_pending(s))
+			drain(sv[1]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		drain(sv[1]);
+
+		flush_calls += calls;
+		t += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+
+	fprintf(stderr, "%s: %d byte backlog in %d byte writes, %d rounds\n",
+		use_writev ? "writev" : "write", backlog, chunk, rounds);
+	fprintf(stderr, "%.1f syscalls per flush, %.1f us per flush (%.0f MB/s)\n",
+		(double) flush_calls / rounds, t * 1e6 / rounds,
+		(double) backlog * rounds / t / 1e6);
+
+	ustream_free(s);
+	close(sv[0]);
+	close(sv[1]);
+	uloop_done();
+	free(data);
+
+	return 0;
+}
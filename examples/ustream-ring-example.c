@@ -0,0 +1,182 @@
+/*
+ * ustream-ring-example.c - move data through ring buffered streams
+ *
+ * Usage: ustream-ring-example [-b bytes]
+ *
+ * Writes a counting pattern over a socketpair. Both the write buffer of
+ * the sender and the read buffer of the receiver use ustream_alloc_ring
+ * with sizes that are no multiple of the write and consume chunks, so
+ * data and tail keep wrapping around the end of the ring. The receiver
+ * consumes odd amounts and verifies every byte. A second run keeps the
+ * data 0-terminated (string_data), a third marks the lists adaptive,
+ * which must leave a ring alone.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+#define PATTERN(pos)	((unsigned char) ((pos) % 251))
+
+static struct ustream_fd tx, rx;
+static struct uloop_timeout fail_timer;
+static unsigned long total = 20 * 1000 * 1000;
+static unsigned long wpos, rpos;
+static int errors, extra_bufs, failed;
+
+static void check(const char *name, bool ok)
+{
+	fprintf(stderr, "%-40s %s\n", name, ok ? "ok" : "FAILED");
+	if (!ok)
+		failed++;
+}
+
+static void fill(void)
+{
+	char buf[3001];
+	int i, len, wr;
+
+	while (wpos < total) {
+		len = sizeof(buf);
+		if (total - wpos < (unsigned long) len)
+			len = total - wpos;
+
+		for (i = 0; i < len; i++)
+			buf[i] = PATTERN(wpos + i);
+
+		wr = ustream_write(&tx.stream, buf, len, false);
+		wpos += wr;
+		if (wr < len)
+			break;
+	}
+
+	if (tx.stream.w.buffers > 1)
+		extra_bufs++;
+}
+
+static void tx_notify_write(struct ustream *s, int bytes)
+{
+	fill();
+}
+
+static void rx_notify_read(struct ustream *s, int bytes)
+{
+	char *data;
+	int i, len;
+
+	while ((data = ustream_get_read_buf(s, &len)) != NULL) {
+		if (s->string_data && data[len])
+			errors++;
+
+		/* leave some data behind to move the ring around */
+		if (len > 777)
+			len -= 333;
+
+		for (i = 0; i < len; i++)
+			if ((unsigned char) data[i] != PATTERN(rpos + i))
+				errors++;
+
+		rpos += len;
+		ustream_consume(s, len);
+	}
+
+	if (s->r.buffers > 1)
+		extra_bufs++;
+
+	if (rpos == total)
+		uloop_end();
+}
+
+static void fail_cb(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+static void run(const char *name, bool string_data, bool adaptive)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv)) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	memset(&tx, 0, sizeof(tx));
+	tx.stream.w.alloc = ustream_alloc_ring;
+	tx.stream.w.buffer_len = 8192;
+	tx.stream.w.adaptive = adaptive;
+	tx.stream.notify_write = tx_notify_write;
+	ustream_fd_init(&tx, sv[0]);
+
+	memset(&rx, 0, sizeof(rx));
+	rx.stream.r.alloc = ustream_alloc_ring;
+	rx.stream.r.buffer_len = 5000;
+	rx.stream.r.adaptive = adaptive;
+	rx.stream.string_data = string_data;
+	rx.stream.notify_read = rx_notify_read;
+	ustream_fd_init(&rx, sv[1]);
+
+	wpos = rpos = 0;
+	errors = extra_bufs = 0;
+
+	fail_timer.cb = fail_cb;
+	uloop_timeout_set(&fail_timer, 30 * 1000);
+	fill();
+	uloop_run();
+	uloop_timeout_cancel(&fail_timer);
+
+	check(name, rpos == total && !errors && !extra_bufs);
+
+	ustream_free(&tx.stream);
+	ustream_free(&rx.stream);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static int usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-b bytes]\n", name);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:")) != -1) {
+		switch (ch) {
+		case 'b':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	uloop_init();
+
+	run("ring wraps around", false, false);
+	run("ring wraps around with string data", true, false);
+	run("adaptive flag leaves rings alone", false, true);
+
+	uloop_done();
+
+	return !!failed;
+}
@@ -0,0 +1,336 @@
+/*
+ * ustream-sendfile-example.c - ordering of ustream_sendfile with buffered
+ * writes, and a ustream_splice run
+ *
+ * Each check sends a sequence of buffered data and file ranges over a
+ * socketpair and verifies the bytes arrive in the order they were queued.
+ * The first uses sendfile(), the second the copy fallback of a stream
+ * with fd passing, where an fd is attached behind the queued file range.
+ * The splice run forwards a socket through ustream_splice and checks the
+ * byte count and that the number of open fds stays bounded.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+#define CHUNK		(64 * 1024)
+#define SPLICE_BYTES	(8 * 1024 * 1024)
+
+struct segment {
+	char c;
+	int len;
+};
+
+static struct ustream_fd tx, rx;
+static struct uloop_timeout fail_timer;
+static const struct segment *segs;
+static uint64_t rx_bytes, rx_total, fd_start, fd_end;
+static int notified, rx_errors, max_fds, failed;
+static bool fd_received;
+
+static void check(const char *name, bool ok)
+{
+	fprintf(stderr, "%-40s %s\n", name, ok ? "ok" : "FAILED");
+	if (!ok)
+		failed++;
+}
+
+static int count_fds(void)
+{
+	DIR *d = opendir("/proc/self/fd");
+	int n = 0;
+
+	if (!d)
+		return 0;
+
+	while (readdir(d))
+		n++;
+	closedir(d);
+
+	return n;
+}
+
+static char expected(uint64_t pos)
+{
+	const struct segment *seg;
+
+	for (seg = segs; seg->len; seg++) {
+		if (pos < (uint64_t) seg->len)
+			return seg->c;
+		pos -= seg->len;
+	}
+
+	return 0;
+}
+
+static void rx_notify_read(struct ustream *s, int bytes)
+{
+	char *data;
+	int i, len;
+
+	/* fds come with the first byte after them, in the same read */
+	if (fd_received) {
+		fd_start = rx_bytes + s->r.data_bytes - bytes;
+		fd_end = fd_start + bytes;
+		fd_received = false;
+	}
+
+	while ((data = ustream_get_read_buf(s, &len)) != NULL) {
+		for (i = 0; i < len; i++)
+			if (data[i] != expected(rx_bytes + i))
+				rx_errors++;
+
+		rx_bytes += len;
+		ustream_consume(s, len);
+	}
+
+	if (max_fds) {
+		i = count_fds();
+		if (i > max_fds)
+			max_fds = i;
+	}
+
+	if (rx_bytes >= rx_total)
+		uloop_end();
+}
+
+static void rx_notify_fds(struct ustream_fd *s, int *fds, int n_fds)
+{
+	int i;
+
+	fd_received = true;
+	for (i = 0; i < n_fds; i++)
+		close(fds[i]);
+}
+
+static void tx_notify_write(struct ustream *s, int bytes)
+{
+	notified += bytes;
+}
+
+static void fail_cb(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+static void run(uint64_t total)
+{
+	rx_total = total;
+	fail_timer.cb = fail_cb;
+	uloop_timeout_set(&fail_timer, 10 * 1000);
+	uloop_run();
+	uloop_timeout_cancel(&fail_timer);
+}
+
+static int tmpfile_fill(char c, int len)
+{
+	char path[] = "/tmp/ustream-sendfile-XXXXXX";
+	char buf[4096];
+	int fd, n;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+
+	unlink(path);
+	memset(buf, c, sizeof(buf));
+	for (n = 0; n < len; n += sizeof(buf))
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			return -1;
+
+	return fd;
+}
+
+static void open_pair(bool fd_passing)
+{
+	int sv[2], sndbuf = 4096;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv)) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	/* keep the socket buffer small so that writes get queued */
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	memset(&tx, 0, sizeof(tx));
+	memset(&rx, 0, sizeof(rx));
+	tx.stream.notify_write = tx_notify_write;
+	rx.stream.notify_read = rx_notify_read;
+	ustream_fd_init(&tx, sv[0]);
+	ustream_fd_init(&rx, sv[1]);
+
+	if (fd_passing) {
+		ustream_fd_set_fd_passing(&tx, NULL);
+		ustream_fd_set_fd_passing(&rx, rx_notify_fds);
+	}
+
+	rx_bytes = 0;
+	rx_errors = 0;
+	notified = 0;
+}
+
+static void close_pair(void)
+{
+	ustream_free(&tx.stream);
+	ustream_free(&rx.stream);
+	close(tx.fd.fd);
+	close(rx.fd.fd);
+}
+
+/* queue a buffered write, returns the bytes left for the write path */
+static int write_fill(char c, int len)
+{
+	int pending = ustream_pending_data(&tx.stream, true);
+	char buf[CHUNK];
+
+	memset(buf, c, sizeof(buf));
+	ustream_write(&tx.stream, buf, len, false);
+
+	return ustream_pending_data(&tx.stream, true) - pending;
+}
+
+static int sendfile_fill(int fd, int len)
+{
+	int pending = ustream_pending_data(&tx.stream, true);
+
+	ustream_sendfile(&tx.stream, fd, 0, len);
+
+	return ustream_pending_data(&tx.stream, true) - pending;
+}
+
+static void test_order(void)
+{
+	static const struct segment seq[] = {
+		{ 'A', CHUNK }, { 'B', 4 * CHUNK }, { 'C', CHUNK }, {}
+	};
+	int fd, queued = 0;
+
+	open_pair(false);
+	segs = seq;
+	fd = tmpfile_fill('B', 4 * CHUNK);
+
+	queued += write_fill('A', CHUNK);
+	queued += sendfile_fill(fd, 4 * CHUNK);
+	queued += write_fill('C', CHUNK);
+	close(fd);
+
+	run(6 * CHUNK);
+	check("buffered, sendfile, buffered in order",
+	      rx_bytes == 6 * CHUNK && !rx_errors);
+	check("notify_write reports queued bytes", notified == queued);
+	close_pair();
+}
+
+static void test_fds(void)
+{
+	static const struct segment seq[] = {
+		{ 'A', CHUNK }, { 'B', 4 * CHUNK }, { 'C', CHUNK }, {}
+	};
+	char buf[CHUNK];
+	int fd;
+
+	open_pair(true);
+	segs = seq;
+	fd = tmpfile_fill('B', 4 * CHUNK);
+	fd_start = fd_end = 0;
+
+	write_fill('A', CHUNK);
+	sendfile_fill(fd, 4 * CHUNK);
+	memset(buf, 'C', sizeof(buf));
+	ustream_fd_write_fds(&tx, buf, CHUNK, &fd, 1);
+	close(fd);
+
+	run(6 * CHUNK);
+	check("copy fallback in order", rx_bytes == 6 * CHUNK && !rx_errors);
+	check("fds arrive behind the file range",
+	      fd_start <= 5 * CHUNK && fd_end > 5 * CHUNK);
+	close_pair();
+}
+
+static void splice_notify_eof(struct ustream_splice *sp)
+{
+	uloop_end();
+}
+
+static void test_splice(void)
+{
+	static const struct segment seq[] = {
+		{ 'S', SPLICE_BYTES }, {}
+	};
+	struct ustream_fd src, feed;
+	struct ustream_splice sp = {};
+	char buf[CHUNK];
+	int sv[2], base, i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv)) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	open_pair(false);
+	segs = seq;
+	memset(&src, 0, sizeof(src));
+	memset(&feed, 0, sizeof(feed));
+	ustream_fd_init(&src, sv[0]);
+	ustream_fd_init(&feed, sv[1]);
+
+	sp.notify_eof = splice_notify_eof;
+	if (ustream_splice_init(&sp, &src, &tx.stream)) {
+		check("splice", false);
+		return;
+	}
+
+	base = count_fds();
+	max_fds = base;
+
+	memset(buf, 'S', sizeof(buf));
+	for (i = 0; i < SPLICE_BYTES / CHUNK; i++)
+		ustream_write(&feed.stream, buf, CHUNK, false);
+
+	run(SPLICE_BYTES);
+	check("splice forwards all bytes",
+	      rx_bytes == SPLICE_BYTES && sp.bytes == SPLICE_BYTES && !rx_errors);
+	check("splice keeps one fd per pipe", max_fds <= base + 1);
+	max_fds = 0;
+
+	ustream_splice_free(&sp);
+	ustream_free(&feed.stream);
+	ustream_free(&src.stream);
+	close(sv[0]);
+	close(sv[1]);
+	close_pair();
+}
+
+int main(int argc, char **argv)
+{
+	uloop_init();
+
+	test_order();
+	test_fds();
+	test_splice();
+
+	uloop_done();
+
+	return !!failed;
+}
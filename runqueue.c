@@ -21,9 +21,9 @@
 #include "runqueue.h"
 
 static void
-__runqueue_empty_cb(struct uloop_timeout *timeout)
+__runqueue_empty_cb(struct uloop_defer *d)
 {
-	struct runqueue *q = container_of(timeout, struct runqueue, timeout);
+	struct runqueue *q = container_of(d, struct runqueue, defer);
 
 	q->empty_cb(q);
 }
@@ -34,9 +34,16 @@ void runqueue_init(struct runqueue *q)
 	INIT_SAFE_LIST(&q->tasks_inactive);
 }
 
-static void __runqueue_start_next(struct uloop_timeout *timeout)
+/* task timeouts are only a safety net, they do not need to be exact */
+static void runqueue_task_timeout_set(struct runqueue_task *t, int msecs)
 {
-	struct runqueue *q = container_of(timeout, struct runqueue, timeout);
+	t->timeout.slack = msecs / 16;
+	uloop_timeout_set(&t->timeout, msecs);
+}
+
+static void __runqueue_start_next(struct uloop_defer *d)
+{
+	struct runqueue *q = container_of(d, struct runqueue, defer);
 	struct runqueue_task *t;
 
 	do {
@@ -55,7 +62,7 @@ static void __runqueue_start_next(struct uloop_timeout *timeout)
 		t->running = true;
 		q->running_tasks++;
 		if (t->run_timeout)
-			uloop_timeout_set(&t->timeout, t->run_timeout);
+			runqueue_task_timeout_set(t, t->run_timeout);
 		t->type->run(q, t);
 	} while (1);
 
@@ -64,8 +71,9 @@ static void __runqueue_start_next(struct uloop_timeout *timeout)
 	    list_empty(&q->tasks_inactive.list)) {
 		q->empty = true;
 		if (q->empty_cb) {
-			q->timeout.cb = __runqueue_empty_cb;
-			uloop_timeout_set(&q->timeout, 1);
+			uloop_defer_cancel(&q->defer);
+			q->defer.cb = __runqueue_empty_cb;
+			uloop_defer_add(&q->defer);
 		}
 	}
 }
@@ -75,8 +83,9 @@ static void runqueue_start_next(struct runqueue *q)
 	if (q->empty)
 		return;
 
-	q->timeout.cb = __runqueue_start_next;
-	uloop_timeout_set(&q->timeout, 1);
+	uloop_defer_cancel(&q->defer);
+	q->defer.cb = __runqueue_start_next;
+	uloop_defer_add(&q->defer);
 }
 
 static int __runqueue_cancel(void *ctx, struct safe_list *list)
@@ -115,6 +124,7 @@ void runqueue_kill(struct runqueue *q)
 	}
 	runqueue_cancel_pending(q);
 	uloop_timeout_cancel(&q->timeout);
+	uloop_defer_cancel(&q->defer);
 }
 
 void runqueue_task_cancel(struct runqueue_task *t, int type)
@@ -129,7 +139,7 @@ void runqueue_task_cancel(struct runqueue_task *t, int type)
 
 	t->cancelled = true;
 	if (t->cancel_timeout)
-		uloop_timeout_set(&t->timeout, t->cancel_timeout);
+		runqueue_task_timeout_set(t, t->cancel_timeout);
 	if (t->type->cancel)
 		t->type->cancel(t->q, t, type);
 }
@@ -30,7 +30,10 @@ struct runqueue_task_type;
 struct runqueue {
 	struct safe_list tasks_active;
 	struct safe_list tasks_inactive;
+
+	/* no longer used, kept for existing users of the struct */
 	struct uloop_timeout timeout;
+	struct uloop_defer defer;
 
 	int running_tasks;
 	int max_running_tasks;
@@ -0,0 +1,409 @@
+/*
+ * udgram - batched datagram socket I/O
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "udgram.h"
+#include "utils.h"
+
+#ifdef __linux__
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP		17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+#endif
+
+#define UDGRAM_BATCH_SIZE	32
+#define UDGRAM_BUFFER_LEN	2048
+#define UDGRAM_GRO_BUFFER_LEN	65536
+
+/* batches received per wakeup before giving other fds a turn */
+#define UDGRAM_RX_ROUNDS	4
+
+#ifndef __linux__
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+static int recvmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags, void *timeout)
+{
+	unsigned int i;
+	ssize_t len;
+
+	for (i = 0; i < n; i++) {
+		len = recvmsg(fd, &msgs[i].msg_hdr, flags);
+		if (len < 0)
+			return i ? i : -1;
+
+		msgs[i].msg_len = len;
+	}
+
+	return n;
+}
+
+static int sendmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	unsigned int i;
+	ssize_t len;
+
+	for (i = 0; i < n; i++) {
+		len = sendmsg(fd, &msgs[i].msg_hdr, flags);
+		if (len < 0)
+			return i ? i : -1;
+
+		msgs[i].msg_len = len;
+	}
+
+	return n;
+}
+#endif
+
+#define UDGRAM_CMSG_LEN	CMSG_SPACE(sizeof(int))
+
+static int udgram_segment_size(struct msghdr *msg)
+{
+#ifdef __linux__
+	struct cmsghdr *cmsg;
+	int val;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+			continue;
+
+		memcpy(&val, CMSG_DATA(cmsg), sizeof(val));
+		return val;
+	}
+#endif
+
+	return 0;
+}
+
+static void udgram_recv(struct udgram *u)
+{
+	int i, n, round;
+
+	for (round = 0; round < UDGRAM_RX_ROUNDS; round++) {
+		for (i = 0; i < u->batch_size; i++) {
+			struct msghdr *msg = &u->rx_msgs[i].msg_hdr;
+
+			msg->msg_namelen = sizeof(u->rx_pkts[i].addr);
+			msg->msg_controllen = u->gro ? UDGRAM_CMSG_LEN : 0;
+			msg->msg_flags = 0;
+		}
+
+		n = recvmmsg(u->fd.fd, u->rx_msgs, u->batch_size, MSG_DONTWAIT, NULL);
+		u->stats.rx_syscalls++;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct udgram_pkt *pkt = &u->rx_pkts[i];
+			struct msghdr *msg = &u->rx_msgs[i].msg_hdr;
+
+			pkt->len = u->rx_msgs[i].msg_len;
+			pkt->addr_len = msg->msg_namelen;
+			pkt->segment_size = u->gro ? udgram_segment_size(msg) : 0;
+		}
+
+		u->stats.rx_packets += n;
+		if (u->notify_recv)
+			u->notify_recv(u, u->rx_pkts, n);
+
+		if (n < u->batch_size || !u->fd.registered)
+			return;
+	}
+}
+
+static void udgram_set_write_wait(struct udgram *u, bool wait)
+{
+	unsigned int flags = ULOOP_READ | (wait ? ULOOP_WRITE : 0);
+
+	if (u->fd.registered && u->fd.flags == flags)
+		return;
+
+	uloop_fd_add(&u->fd, flags);
+}
+
+int udgram_flush(struct udgram *u)
+{
+	int sent = 0, n, i;
+
+	uloop_defer_cancel(&u->flush);
+
+	while (sent < u->tx_queued) {
+		n = sendmmsg(u->fd.fd, &u->tx_msgs[sent], u->tx_queued - sent, MSG_DONTWAIT);
+		u->stats.tx_syscalls++;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				break;
+
+			/* the first message was rejected, drop it and go on */
+			u->stats.tx_dropped++;
+			sent++;
+			continue;
+		}
+
+		u->stats.tx_packets += n;
+		sent += n;
+	}
+
+	if (sent) {
+		/* move the remaining messages to the front of the queue */
+		for (i = 0; i + sent < u->tx_queued; i++) {
+			struct msghdr *dst = &u->tx_msgs[i].msg_hdr;
+			struct msghdr *src = &u->tx_msgs[i + sent].msg_hdr;
+
+			memcpy(dst->msg_iov->iov_base, src->msg_iov->iov_base,
+			       src->msg_iov->iov_len);
+			dst->msg_iov->iov_len = src->msg_iov->iov_len;
+
+			if (src->msg_name) {
+				memcpy(&u->tx_addr[i], src->msg_name, src->msg_namelen);
+				dst->msg_name = &u->tx_addr[i];
+			} else {
+				dst->msg_name = NULL;
+			}
+			dst->msg_namelen = src->msg_namelen;
+		}
+		u->tx_queued -= sent;
+	}
+
+	udgram_set_write_wait(u, u->tx_queued > 0);
+
+	return u->tx_queued;
+}
+
+static void udgram_flush_cb(struct uloop_defer *d)
+{
+	udgram_flush(container_of(d, struct udgram, flush));
+}
+
+int udgram_send(struct udgram *u, const void *data, int len,
+		const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct msghdr *msg;
+
+	if (len < 0 || len > u->buffer_len || addr_len > sizeof(*u->tx_addr)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/* nothing is dropped, the caller can retry once the socket drains */
+	if (u->tx_queued == u->batch_size && udgram_flush(u) == u->batch_size) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	msg = &u->tx_msgs[u->tx_queued].msg_hdr;
+	memcpy(msg->msg_iov->iov_base, data, len);
+	msg->msg_iov->iov_len = len;
+
+	if (addr) {
+		memcpy(&u->tx_addr[u->tx_queued], addr, addr_len);
+		msg->msg_name = &u->tx_addr[u->tx_queued];
+		msg->msg_namelen = addr_len;
+	} else {
+		msg->msg_name = NULL;
+		msg->msg_namelen = 0;
+	}
+
+	if (++u->tx_queued == u->batch_size)
+		udgram_flush(u);
+	else if (!u->flush.pending && !(u->fd.flags & ULOOP_WRITE))
+		uloop_defer_add(&u->flush);
+
+	return 0;
+}
+
+int udgram_send_gso(struct udgram *u, const void *data, int len, int segment_size,
+		    const struct sockaddr *addr, socklen_t addr_len)
+{
+	const char *buf = data;
+	int ofs;
+
+	if (segment_size <= 0 || len < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (u->tx_queued && udgram_flush(u)) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+#ifdef __linux__
+	if (len > segment_size) {
+		char cbuf[CMSG_SPACE(sizeof(uint16_t))] = {};
+		uint16_t val = segment_size;
+		struct iovec iov = {
+			.iov_base = (void *) data,
+			.iov_len = len,
+		};
+		struct msghdr msg = {
+			.msg_name = (void *) addr,
+			.msg_namelen = addr ? addr_len : 0,
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = cbuf,
+			.msg_controllen = sizeof(cbuf),
+		};
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		ssize_t ret;
+
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(val));
+		memcpy(CMSG_DATA(cmsg), &val, sizeof(val));
+
+		do {
+			ret = sendmsg(u->fd.fd, &msg, MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+		u->stats.tx_syscalls++;
+
+		if (ret >= 0) {
+			u->stats.tx_packets += (len + segment_size - 1) / segment_size;
+			return 0;
+		}
+
+		/* fall back to queueing the segments if GSO is not supported */
+		if (errno != EIO && errno != EINVAL && errno != EOPNOTSUPP &&
+		    errno != ENOPROTOOPT)
+			return -1;
+	}
+#endif
+
+	for (ofs = 0; ofs < len; ofs += segment_size) {
+		int cur = len - ofs;
+
+		if (cur > segment_size)
+			cur = segment_size;
+
+		if (udgram_send(u, buf + ofs, cur, addr, addr_len))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void udgram_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct udgram *u = container_of(fd, struct udgram, fd);
+
+	if (events & ULOOP_WRITE)
+		udgram_flush(u);
+
+	if (events & ULOOP_READ)
+		udgram_recv(u);
+}
+
+int udgram_init(struct udgram *u, int fd)
+{
+	int batch, len, i;
+
+	if (!u->batch_size)
+		u->batch_size = UDGRAM_BATCH_SIZE;
+	if (!u->buffer_len)
+		u->buffer_len = u->gro ? UDGRAM_GRO_BUFFER_LEN : UDGRAM_BUFFER_LEN;
+
+	batch = u->batch_size;
+	len = u->buffer_len;
+
+	u->rx_pkts = calloc_a(batch * sizeof(*u->rx_pkts),
+			      &u->rx_msgs, batch * sizeof(*u->rx_msgs),
+			      &u->tx_msgs, batch * sizeof(*u->tx_msgs),
+			      &u->rx_iov, batch * sizeof(*u->rx_iov),
+			      &u->tx_iov, batch * sizeof(*u->tx_iov),
+			      &u->tx_addr, batch * sizeof(*u->tx_addr),
+			      &u->rx_cbuf, batch * UDGRAM_CMSG_LEN,
+			      &u->rx_buf, (size_t) batch * len,
+			      &u->tx_buf, (size_t) batch * len);
+	if (!u->rx_pkts)
+		return -1;
+
+	for (i = 0; i < batch; i++) {
+		struct msghdr *msg;
+
+		u->rx_iov[i].iov_base = u->rx_buf + (size_t) i * len;
+		u->rx_iov[i].iov_len = len;
+		u->rx_pkts[i].data = u->rx_iov[i].iov_base;
+
+		msg = &u->rx_msgs[i].msg_hdr;
+		msg->msg_name = &u->rx_pkts[i].addr;
+		msg->msg_iov = &u->rx_iov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = u->rx_cbuf + i * UDGRAM_CMSG_LEN;
+
+		u->tx_iov[i].iov_base = u->tx_buf + (size_t) i * len;
+		msg = &u->tx_msgs[i].msg_hdr;
+		msg->msg_iov = &u->tx_iov[i];
+		msg->msg_iovlen = 1;
+	}
+
+#ifdef __linux__
+	if (u->gro) {
+		const int one = 1;
+
+		if (setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)))
+			u->gro = false;
+	}
+#else
+	u->gro = false;
+#endif
+
+	u->tx_queued = 0;
+	u->flush.cb = udgram_flush_cb;
+	u->fd.fd = fd;
+	u->fd.cb = udgram_fd_cb;
+
+	if (uloop_fd_add(&u->fd, ULOOP_READ) < 0) {
+		free(u->rx_pkts);
+		u->rx_pkts = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void udgram_free(struct udgram *u)
+{
+	uloop_defer_cancel(&u->flush);
+	uloop_fd_delete(&u->fd);
+	free(u->rx_pkts);
+	u->rx_pkts = NULL;
+	u->tx_queued = 0;
+}
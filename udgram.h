@@ -0,0 +1,112 @@
+/*
+ * udgram - batched datagram socket I/O
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UDGRAM_H
+#define __UDGRAM_H
+
+#include <sys/socket.h>
+#include "uloop.h"
+
+struct udgram;
+struct mmsghdr;
+
+struct udgram_pkt {
+	void *data;
+	int len;
+
+	/*
+	 * with GRO, data holds several datagrams of segment_size bytes
+	 * each (the last one may be shorter), 0 for a single datagram
+	 */
+	int segment_size;
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+};
+
+struct udgram_stats {
+	uint64_t rx_packets;
+	uint64_t rx_syscalls;
+	uint64_t tx_packets;
+	uint64_t tx_syscalls;
+
+	/* messages the kernel rejected, sends failing with EAGAIN are not counted */
+	uint64_t tx_dropped;
+};
+
+/*
+ * udgram: a datagram socket on top of uloop_fd that receives and sends
+ * in batches of up to batch_size messages per syscall (recvmmsg/sendmmsg
+ * on Linux).
+ *
+ * Received messages are passed to notify_recv one batch at a time. The
+ * data is only valid during the callback. udgram_free() may be called
+ * from the callback, but the struct must not be freed.
+ *
+ * udgram_send() copies the message into a preallocated slot; queued
+ * messages go out together on the next loop iteration, when the queue is
+ * full or on udgram_flush(). If the socket is not writable, they stay
+ * queued until it is and further sends fail with EAGAIN once the queue
+ * is full.
+ */
+struct udgram {
+	struct uloop_fd fd;
+
+	void (*notify_recv)(struct udgram *u, struct udgram_pkt *pkts, int n);
+
+	/* messages per syscall, default 32 */
+	int batch_size;
+
+	/* max size of a single message, default 2048 (64k with gro) */
+	int buffer_len;
+
+	/* use UDP generic receive offload (Linux) */
+	bool gro;
+
+	struct udgram_stats stats;
+
+	/* internal */
+	struct uloop_defer flush;
+	struct udgram_pkt *rx_pkts;
+	struct mmsghdr *rx_msgs, *tx_msgs;
+	struct iovec *rx_iov, *tx_iov;
+	struct sockaddr_storage *tx_addr;
+	char *rx_buf, *tx_buf, *rx_cbuf;
+	int tx_queued;
+};
+
+/* udgram_init: set up buffers and register fd with uloop */
+int udgram_init(struct udgram *u, int fd);
+
+/* udgram_free: unregister and free buffers, does not close the fd */
+void udgram_free(struct udgram *u);
+
+/* udgram_send: queue a message, addr can be NULL for connected sockets */
+int udgram_send(struct udgram *u, const void *data, int len,
+		const struct sockaddr *addr, socklen_t addr_len);
+
+/*
+ * udgram_send_gso: send len bytes as datagrams of segment_size bytes
+ * each with a single syscall (UDP_SEGMENT on Linux, otherwise one
+ * message per segment). Flushes the queue first to keep the order.
+ */
+int udgram_send_gso(struct udgram *u, const void *data, int len, int segment_size,
+		    const struct sockaddr *addr, socklen_t addr_len);
+
+/* udgram_flush: send queued messages now, returns the number still queued */
+int udgram_flush(struct udgram *u);
+
+#endif
@@ -23,21 +23,150 @@
 #define EPOLLRDHUP 0x2000
 #endif
 
-static int uloop_init_pollfd(void)
+#define ULOOP_POLL_EVENT_SIZE	sizeof(struct epoll_event)
+
+struct uloop_poll_reg {
+	struct uloop_fd *fd;
+	uint32_t events;
+	uint32_t want;
+	bool queued;
+};
+
+static int uloop_init_pollfd(struct uloop_ctx *ctx)
 {
-	if (poll_fd >= 0)
+	if (ctx->poll_fd >= 0)
 		return 0;
 
-	poll_fd = epoll_create(32);
-	if (poll_fd < 0)
+	ctx->poll_fd = epoll_create(32);
+	if (ctx->poll_fd < 0)
 		return -1;
 
-	fcntl(poll_fd, F_SETFD, fcntl(poll_fd, F_GETFD) | FD_CLOEXEC);
+	fcntl(ctx->poll_fd, F_SETFD, fcntl(ctx->poll_fd, F_GETFD) | FD_CLOEXEC);
 	return 0;
 }
 
-static int register_poll(struct uloop_fd *fd, unsigned int flags)
+static void uloop_close_pollfd(struct uloop_ctx *ctx)
+{
+	if (ctx->timer_fd.fd >= 0) {
+		close(ctx->timer_fd.fd);
+		ctx->timer_fd.fd = -1;
+		ctx->timer_fd.registered = false;
+	}
+
+	free(ctx->poll_regs);
+	ctx->poll_regs = NULL;
+	ctx->n_poll_regs = 0;
+
+	free(ctx->poll_changes);
+	ctx->poll_changes = NULL;
+	ctx->n_poll_changes = ctx->poll_changes_size = 0;
+
+	if (ctx->poll_fd < 0)
+		return;
+
+	close(ctx->poll_fd);
+	ctx->poll_fd = -1;
+}
+
+static struct uloop_poll_reg *uloop_poll_reg(struct uloop_ctx *ctx, int fd, bool alloc)
+{
+	struct uloop_poll_reg *regs;
+	int n;
+
+	if (fd < 0)
+		return NULL;
+
+	if (fd < ctx->n_poll_regs)
+		return &ctx->poll_regs[fd];
+
+	if (!alloc)
+		return NULL;
+
+	n = ctx->n_poll_regs ? ctx->n_poll_regs : 64;
+	while (n <= fd)
+		n *= 2;
+
+	regs = realloc(ctx->poll_regs, n * sizeof(*regs));
+	if (!regs)
+		return NULL;
+
+	memset(&regs[ctx->n_poll_regs], 0, (n - ctx->n_poll_regs) * sizeof(*regs));
+	ctx->poll_regs = regs;
+	ctx->n_poll_regs = n;
+
+	return &regs[fd];
+}
+
+/* queue a change of an already registered fd until the next epoll_wait */
+static bool uloop_poll_queue(struct uloop_ctx *ctx, struct uloop_fd *fd, uint32_t events)
+{
+	struct uloop_poll_reg *reg;
+	int *changes;
+	int n;
+
+	reg = uloop_poll_reg(ctx, fd->fd, false);
+	if (!reg || reg->fd != fd)
+		return false;
+
+	if (reg->queued) {
+		ctx->stats.fd_syscalls_saved++;
+		reg->want = events;
+		return true;
+	}
+
+	if (ctx->n_poll_changes == ctx->poll_changes_size) {
+		n = ctx->poll_changes_size ? ctx->poll_changes_size * 2 : 32;
+		changes = realloc(ctx->poll_changes, n * sizeof(*changes));
+		if (!changes)
+			return false;
+
+		ctx->poll_changes = changes;
+		ctx->poll_changes_size = n;
+	}
+
+	ctx->poll_changes[ctx->n_poll_changes++] = fd->fd;
+	reg->want = events;
+	reg->queued = true;
+
+	return true;
+}
+
+static void uloop_poll_flush(struct uloop_ctx *ctx)
+{
+	struct uloop_poll_reg *reg;
+	struct epoll_event ev;
+	int i;
+
+	for (i = 0; i < ctx->n_poll_changes; i++) {
+		reg = &ctx->poll_regs[ctx->poll_changes[i]];
+		reg->queued = false;
+		if (!reg->fd)
+			continue;
+
+		/* edge triggered fds need the modification to be re-armed */
+		if (reg->want == reg->events && !(reg->want & EPOLLET)) {
+			ctx->stats.fd_syscalls_saved++;
+			continue;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = reg->want;
+		ev.data.ptr = reg->fd;
+		ctx->stats.fd_syscalls++;
+		if (epoll_ctl(ctx->poll_fd, EPOLL_CTL_MOD, reg->fd->fd, &ev) < 0) {
+			reg->fd->error = true;
+			continue;
+		}
+
+		reg->events = reg->want;
+	}
+
+	ctx->n_poll_changes = 0;
+}
+
+static int register_poll(struct uloop_ctx *ctx, struct uloop_fd *fd, unsigned int flags)
 {
+	struct uloop_poll_reg *reg;
 	struct epoll_event ev;
 	int op = fd->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
 
@@ -58,24 +187,83 @@ static int register_poll(struct uloop_fd *fd, unsigned int flags)
 	ev.data.ptr = fd;
 	fd->flags = flags;
 
-	return epoll_ctl(poll_fd, op, fd->fd, &ev);
-}
+	if (!uloop_batch_fd_updates)
+		goto out;
 
-static struct epoll_event events[ULOOP_MAX_EVENTS];
+	if (op == EPOLL_CTL_MOD && uloop_poll_queue(ctx, fd, ev.events))
+		return 0;
 
-static int __uloop_fd_delete(struct uloop_fd *sock)
+	reg = uloop_poll_reg(ctx, fd->fd, true);
+	if (reg) {
+		reg->fd = fd;
+		reg->events = reg->want = ev.events;
+	}
+
+out:
+	ctx->stats.fd_syscalls++;
+	return epoll_ctl(ctx->poll_fd, op, fd->fd, &ev);
+}
+
+static int __uloop_fd_delete(struct uloop_ctx *ctx, struct uloop_fd *sock)
 {
+	struct uloop_poll_reg *reg;
+
+	reg = uloop_poll_reg(ctx, sock->fd, false);
+	if (reg && reg->fd == sock)
+		reg->fd = NULL;
+
 	sock->flags = 0;
-	return epoll_ctl(poll_fd, EPOLL_CTL_DEL, sock->fd, 0);
+	ctx->stats.fd_syscalls++;
+	return epoll_ctl(ctx->poll_fd, EPOLL_CTL_DEL, sock->fd, 0);
+}
+
+static void timer_fd_consume(struct uloop_fd *fd, unsigned int events)
+{
+	uint64_t val;
+
+	while (read(fd->fd, &val, sizeof(val)) < 0 && errno == EINTR)
+		;
 }
 
-static int uloop_fetch_events(int timeout)
+static int uloop_timer_fd_arm(struct uloop_ctx *ctx, int64_t timeout)
 {
-	int n, nfds;
+	struct itimerspec its = {};
+
+	if (ctx->timer_fd.fd < 0) {
+		ctx->timer_fd.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (ctx->timer_fd.fd < 0)
+			return -1;
+
+		ctx->timer_fd.cb = timer_fd_consume;
+		uloop_ctx_fd_add(ctx, &ctx->timer_fd, ULOOP_READ);
+	}
+
+	its.it_value.tv_sec = timeout / NSEC_PER_SEC;
+	its.it_value.tv_nsec = timeout % NSEC_PER_SEC;
+
+	return timerfd_settime(ctx->timer_fd.fd, 0, &its, NULL);
+}
+
+static int uloop_fetch_events(struct uloop_ctx *ctx, int64_t timeout)
+{
+	struct epoll_event *events = ctx->events;
+	int n, nfds, msecs = -1;
+
+	if (timeout >= 0) {
+		/* round up, the timerfd takes care of the remainder */
+		if (uloop_use_timerfd && timeout % NSEC_PER_MSEC)
+			uloop_timer_fd_arm(ctx, timeout);
+
+		timeout = (timeout + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+		msecs = timeout > INT_MAX ? INT_MAX : timeout;
+	}
+
+	if (ctx->n_poll_changes)
+		uloop_poll_flush(ctx);
 
-	nfds = epoll_wait(poll_fd, events, ARRAY_SIZE(events), timeout);
+	nfds = epoll_wait(ctx->poll_fd, events, ctx->max_events, msecs);
 	for (n = 0; n < nfds; ++n) {
-		struct uloop_fd_event *cur = &cur_fds[n];
+		struct uloop_fd_event *cur = &ctx->cur_fds[n];
 		struct uloop_fd *u = events[n].data.ptr;
 		unsigned int ev = 0;
 
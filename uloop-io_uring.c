@@ -0,0 +1,598 @@
+/*
+ * uloop - event loop implementation
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * io_uring backend, needs Linux >= 5.13 (multishot poll, IORING_ENTER_EXT_ARG)
+ *
+ * Edge triggered fds use a multishot poll request that stays armed until the
+ * fd is modified or deleted. Level triggered fds use a oneshot poll request
+ * which is re-armed right before the next wait, after their callback ran.
+ * Poll requests are identified by fd number and a generation counter, so
+ * completions of requests that were removed in the meantime are ignored.
+ */
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000
+#endif
+
+#define ULOOP_POLL_EVENT_SIZE	sizeof(struct io_uring_cqe)
+
+#define URING_ENTRIES		256
+#define URING_POLL_TAG		(1ULL << 63)
+#define URING_GEN_MASK		0x7fffffff
+
+struct uloop_uring_reg {
+	struct uloop_fd *fd;
+	uint32_t gen;
+	uint32_t mask;
+	bool multishot;
+	bool armed;
+	bool rearm;
+
+	/* index into cur_fds for merging multiple completions per fetch */
+	unsigned int seq;
+	int cur;
+};
+
+struct uloop_uring {
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_entries;
+	unsigned int to_submit;
+
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	struct uloop_uring_reg *regs;
+	int n_regs;
+
+	int *rearm;
+	int n_rearm, rearm_size;
+
+	unsigned int seq;
+};
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		       unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static void uring_free(struct uloop_uring *r)
+{
+	if (r->sq_ring && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	free(r->regs);
+	free(r->rearm);
+	free(r);
+}
+
+static int uloop_init_pollfd(struct uloop_ctx *ctx)
+{
+	struct io_uring_params p = {};
+	struct uloop_uring *r;
+	int fd;
+
+	if (ctx->poll_fd >= 0)
+		return 0;
+
+	fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		goto error_close;
+
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		goto error_close;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto error_free;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring = r->sq_ring;
+	else
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (r->cq_ring == MAP_FAILED)
+		goto error_free;
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto error_free;
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->sq_entries = p.sq_entries;
+
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+
+	ctx->uring = r;
+	ctx->poll_fd = fd;
+
+	return 0;
+
+error_free:
+	uring_free(r);
+error_close:
+	close(fd);
+	return -1;
+}
+
+static void uloop_close_pollfd(struct uloop_ctx *ctx)
+{
+	if (ctx->poll_fd < 0)
+		return;
+
+	close(ctx->poll_fd);
+	ctx->poll_fd = -1;
+	uring_free(ctx->uring);
+	ctx->uring = NULL;
+}
+
+static int uring_submit(struct uloop_ctx *ctx)
+{
+	struct uloop_uring *r = ctx->uring;
+	int ret;
+
+	while (r->to_submit) {
+		ret = uring_enter(ctx->poll_fd, r->to_submit, 0, 0, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		r->to_submit -= ret;
+	}
+
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uloop_ctx *ctx)
+{
+	struct uloop_uring *r = ctx->uring;
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *r->sq_tail;
+	unsigned int idx;
+
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		if (uring_submit(ctx) < 0)
+			return NULL;
+	}
+
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+static void uring_queue_sqe(struct uloop_ctx *ctx)
+{
+	struct uloop_uring *r = ctx->uring;
+
+	__atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+}
+
+static struct uloop_uring_reg *uring_get_reg(struct uloop_uring *r, int fd)
+{
+	struct uloop_uring_reg *regs;
+	int n;
+
+	if (fd < 0)
+		return NULL;
+
+	if (fd < r->n_regs)
+		return &r->regs[fd];
+
+	n = r->n_regs ? r->n_regs : 64;
+	while (n <= fd)
+		n *= 2;
+
+	regs = realloc(r->regs, n * sizeof(*regs));
+	if (!regs)
+		return NULL;
+
+	memset(&regs[r->n_regs], 0, (n - r->n_regs) * sizeof(*regs));
+	r->regs = regs;
+	r->n_regs = n;
+
+	return &r->regs[fd];
+}
+
+static uint64_t uring_poll_data(int fd, struct uloop_uring_reg *reg)
+{
+	return URING_POLL_TAG | ((uint64_t) (reg->gen & URING_GEN_MASK) << 32) |
+	       (uint32_t) fd;
+}
+
+static int uring_poll_add(struct uloop_ctx *ctx, int fd, struct uloop_uring_reg *reg)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ctx);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = reg->mask;
+	if (reg->multishot)
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = uring_poll_data(fd, reg);
+	uring_queue_sqe(ctx);
+	reg->armed = true;
+
+	return 0;
+}
+
+static void uring_poll_remove(struct uloop_ctx *ctx, int fd, struct uloop_uring_reg *reg)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!reg->armed)
+		return;
+
+	sqe = uring_get_sqe(ctx);
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = uring_poll_data(fd, reg);
+	sqe->user_data = 0;
+	uring_queue_sqe(ctx);
+	reg->armed = false;
+}
+
+static int register_poll(struct uloop_ctx *ctx, struct uloop_fd *fd, unsigned int flags)
+{
+	struct uloop_uring_reg *reg;
+	uint32_t mask = 0;
+
+	reg = uring_get_reg(ctx->uring, fd->fd);
+	if (!reg)
+		return -1;
+
+	if (flags & ULOOP_READ)
+		mask |= POLLIN | POLLRDHUP;
+
+	if (flags & ULOOP_PRIORITY)
+		mask |= POLLPRI | POLLRDHUP;
+
+	if (flags & ULOOP_WRITE)
+		mask |= POLLOUT;
+
+	if (reg->fd)
+		uring_poll_remove(ctx, fd->fd, reg);
+
+	reg->fd = fd;
+	reg->gen++;
+	reg->mask = mask;
+	reg->multishot = !!(flags & ULOOP_EDGE_TRIGGER);
+	fd->flags = flags;
+
+	return uring_poll_add(ctx, fd->fd, reg);
+}
+
+static int __uloop_fd_delete(struct uloop_ctx *ctx, struct uloop_fd *sock)
+{
+	struct uloop_uring_reg *reg;
+
+	sock->flags = 0;
+
+	reg = uring_get_reg(ctx->uring, sock->fd);
+	if (!reg || reg->fd != sock)
+		return 0;
+
+	uring_poll_remove(ctx, sock->fd, reg);
+	reg->fd = NULL;
+	reg->gen++;
+
+	return 0;
+}
+
+static void uring_rearm(struct uloop_ctx *ctx)
+{
+	struct uloop_uring *r = ctx->uring;
+	struct uloop_uring_reg *reg;
+	int i, fd;
+
+	for (i = 0; i < r->n_rearm; i++) {
+		fd = r->rearm[i];
+		reg = &r->regs[fd];
+		reg->rearm = false;
+		if (reg->fd && !reg->armed)
+			uring_poll_add(ctx, fd, reg);
+	}
+
+	r->n_rearm = 0;
+}
+
+static int uring_queue_rearm(struct uloop_uring *r, int fd, struct uloop_uring_reg *reg)
+{
+	int *rearm;
+	int n;
+
+	if (reg->rearm)
+		return 0;
+
+	if (r->n_rearm == r->rearm_size) {
+		n = r->rearm_size ? r->rearm_size * 2 : 64;
+		rearm = realloc(r->rearm, n * sizeof(*rearm));
+		if (!rearm)
+			return -1;
+
+		r->rearm = rearm;
+		r->rearm_size = n;
+	}
+
+	r->rearm[r->n_rearm++] = fd;
+	reg->rearm = true;
+
+	return 0;
+}
+
+static bool uring_fetch_poll(struct uloop_ctx *ctx, struct io_uring_cqe *cqe,
+			     int *nfds)
+{
+	struct uloop_uring *r = ctx->uring;
+	struct uloop_uring_reg *reg;
+	struct uloop_fd_event *cur;
+	struct uloop_fd *u;
+	uint64_t data = cqe->user_data;
+	int fd = (uint32_t) data;
+	unsigned int ev = 0;
+	int res = cqe->res;
+
+	if (fd >= r->n_regs)
+		return true;
+
+	reg = &r->regs[fd];
+	if (!reg->fd || (reg->gen & URING_GEN_MASK) != (uint32_t) (data >> 32 & URING_GEN_MASK))
+		return true;
+
+	/* leave the cqe in the ring until there is room to dispatch it */
+	if (res != -ECANCELED && reg->seq != r->seq && *nfds >= ctx->max_events)
+		return false;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		reg->armed = false;
+
+		/* the poll would be lost, report it as an error on the fd */
+		if (uring_queue_rearm(r, fd, reg) < 0)
+			res = -ENOMEM;
+	}
+
+	if (res == -ECANCELED)
+		return true;
+
+	if (res < 0)
+		res = POLLERR;
+
+	if (reg->seq == r->seq) {
+		cur = &ctx->cur_fds[reg->cur];
+	} else {
+		reg->seq = r->seq;
+		reg->cur = (*nfds)++;
+		cur = &ctx->cur_fds[reg->cur];
+		cur->events = 0;
+	}
+
+	u = reg->fd;
+	cur->fd = u;
+
+	if (res & (POLLERR | POLLHUP)) {
+		u->error = true;
+		if (!(u->flags & ULOOP_ERROR_CB))
+			uloop_fd_delete(u);
+	}
+
+	if (res & POLLRDHUP)
+		u->eof = true;
+
+	if (res & POLLIN)
+		ev |= ULOOP_READ;
+
+	if (res & POLLPRI)
+		ev |= ULOOP_PRIORITY;
+
+	if (res & POLLOUT)
+		ev |= ULOOP_WRITE;
+
+	cur->events |= ev;
+
+	return true;
+}
+
+static int uloop_fetch_events(struct uloop_ctx *ctx, int64_t timeout)
+{
+	struct uloop_uring *r = ctx->uring;
+	struct io_uring_getevents_arg arg = {};
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	int nfds = 0, ret;
+
+	uring_rearm(ctx);
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / NSEC_PER_SEC;
+		ts.tv_nsec = timeout % NSEC_PER_SEC;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+	}
+
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	ret = uring_enter(ctx->poll_fd, r->to_submit, head == tail,
+			  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			  &arg, sizeof(arg));
+	if (ret > 0)
+		r->to_submit -= ret;
+
+	r->seq++;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &r->cqes[head & *r->cq_mask];
+
+		if (cqe->user_data & URING_POLL_TAG) {
+			if (!uring_fetch_poll(ctx, cqe, &nfds))
+				break;
+		} else if (cqe->user_data) {
+			struct uloop_io *io = (struct uloop_io *) (uintptr_t) cqe->user_data;
+
+			if (nfds >= ctx->max_events)
+				break;
+
+			io->res = cqe->res;
+			io->pending = false;
+			ctx->cur_fds[nfds].fd = &io->fd;
+			ctx->cur_fds[nfds].events = ULOOP_READ;
+			nfds++;
+		}
+
+		head++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	return nfds;
+}
+
+static void uloop_io_complete(struct uloop_fd *fd, unsigned int events)
+{
+	struct uloop_io *io = container_of(fd, struct uloop_io, fd);
+
+	if (io->cb)
+		io->cb(io, io->res);
+}
+
+static int uloop_io_submit(struct uloop_io *io, int op, int fd, void *buf, size_t len)
+{
+	struct uloop_ctx *ctx = uloop_ctx_current();
+	struct io_uring_sqe *sqe;
+
+	if (io->pending || !ctx->uring) {
+		errno = io->pending ? EBUSY : ENOTSUP;
+		return -1;
+	}
+
+	sqe = uring_get_sqe(ctx);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = (uint64_t) -1;
+	sqe->user_data = (uint64_t) (uintptr_t) io;
+	uring_queue_sqe(ctx);
+
+	io->fd.cb = uloop_io_complete;
+	io->fd.ctx = ctx;
+	io->pending = true;
+
+	return 0;
+}
+
+int uloop_io_read(struct uloop_io *io, int fd, void *buf, size_t len)
+{
+	return uloop_io_submit(io, IORING_OP_READ, fd, buf, len);
+}
+
+int uloop_io_write(struct uloop_io *io, int fd, const void *buf, size_t len)
+{
+	return uloop_io_submit(io, IORING_OP_WRITE, fd, (void *) buf, len);
+}
+
+int uloop_io_cancel(struct uloop_io *io)
+{
+	struct uloop_ctx *ctx = io->fd.ctx;
+	struct io_uring_sqe *sqe;
+	bool dropped = false;
+	int i;
+
+	if (!ctx) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/*
+	 * a completion that was fetched but not dispatched yet is dropped,
+	 * io is not a registered fd, so look for it in the event batch
+	 */
+	for (i = 0; i < ctx->cur_nfds; i++) {
+		if (ctx->cur_fds[ctx->cur_fd + i].fd != &io->fd)
+			continue;
+
+		ctx->cur_fds[ctx->cur_fd + i].fd = NULL;
+		dropped = true;
+	}
+
+	if (dropped)
+		return 1;
+
+	if (!io->pending) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	sqe = uring_get_sqe(ctx);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t) (uintptr_t) io;
+	sqe->user_data = 0;
+	uring_queue_sqe(ctx);
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * uloop - event loop implementation
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Thread pool for blocking work. Threads are started on demand up to
+ * the configured limit and exit again after being idle for a while.
+ * Results are handed back to the submitting loop through uloop_post().
+ */
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "uloop.h"
+
+#define ULOOP_WORK_THREADS	4
+#define ULOOP_WORK_IDLE_TIME	10
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(work_queue);
+
+static int max_threads = ULOOP_WORK_THREADS;
+static int idle_threads;
+static struct uloop_work_stats work_stats;
+
+static uint64_t work_gettime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void uloop_work_complete(void *arg)
+{
+	struct uloop_work *w = arg;
+
+	uloop_ctx_release(w->ctx);
+	w->pending = false;
+	if (w->done)
+		w->done(w, w->ret);
+}
+
+static void uloop_work_run(struct uloop_work *w)
+{
+	uint64_t start, end;
+
+	start = work_gettime();
+	w->ret = w->cb(w);
+	end = work_gettime();
+
+	pthread_mutex_lock(&work_lock);
+	work_stats.running--;
+	work_stats.completed++;
+	work_stats.run_time += end - start;
+	if (end - start > work_stats.max_run_time)
+		work_stats.max_run_time = end - start;
+	pthread_mutex_unlock(&work_lock);
+
+	/* the entry is part of w, handing back the result cannot fail */
+	w->post.fn = uloop_work_complete;
+	w->post.arg = w;
+	w->post.alloc = false;
+	uloop_post_entry_add(w->ctx, &w->post);
+}
+
+static void *uloop_work_thread(void *arg)
+{
+	struct uloop_work *w;
+	struct timespec ts;
+	uint64_t wait;
+
+	pthread_mutex_lock(&work_lock);
+	while (1) {
+		if (list_empty(&work_queue)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += ULOOP_WORK_IDLE_TIME;
+
+			idle_threads++;
+			while (list_empty(&work_queue)) {
+				if (pthread_cond_timedwait(&work_cond, &work_lock, &ts) == ETIMEDOUT)
+					break;
+			}
+			idle_threads--;
+
+			if (list_empty(&work_queue))
+				break;
+		}
+
+		w = list_first_entry(&work_queue, struct uloop_work, list);
+		list_del(&w->list);
+
+		wait = work_gettime() - w->queued;
+		work_stats.queued--;
+		work_stats.running++;
+		work_stats.wait_time += wait;
+		if (wait > work_stats.max_wait_time)
+			work_stats.max_wait_time = wait;
+		pthread_mutex_unlock(&work_lock);
+
+		uloop_work_run(w);
+
+		pthread_mutex_lock(&work_lock);
+	}
+	work_stats.threads--;
+	pthread_mutex_unlock(&work_lock);
+
+	return NULL;
+}
+
+/* called with work_lock held */
+static int uloop_work_start_thread(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, uloop_work_thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (ret)
+		return -1;
+
+	work_stats.threads++;
+	return 0;
+}
+
+int uloop_work_add(struct uloop_work *w)
+{
+	int ret = 0;
+
+	if (w->pending || !w->cb)
+		return -1;
+
+	w->ctx = uloop_ctx_current();
+	w->queued = work_gettime();
+
+	pthread_mutex_lock(&work_lock);
+	if (idle_threads <= work_stats.queued &&
+	    work_stats.threads < max_threads)
+		uloop_work_start_thread();
+
+	if (!work_stats.threads) {
+		ret = -1;
+		goto out;
+	}
+
+	list_add_tail(&w->list, &work_queue);
+	w->pending = true;
+	uloop_ctx_hold(w->ctx);
+	work_stats.queued++;
+	pthread_cond_signal(&work_cond);
+
+out:
+	pthread_mutex_unlock(&work_lock);
+	return ret;
+}
+
+int uloop_work_cancel(struct uloop_work *w)
+{
+	int ret = -1;
+
+	if (!w->pending)
+		return -1;
+
+	pthread_mutex_lock(&work_lock);
+	if (w->list.next) {
+		list_del(&w->list);
+		w->pending = false;
+		uloop_ctx_release(w->ctx);
+		work_stats.queued--;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&work_lock);
+
+	return ret;
+}
+
+int uloop_work_set_threads(int n)
+{
+	if (n <= 0)
+		return -1;
+
+	pthread_mutex_lock(&work_lock);
+	max_threads = n;
+	pthread_mutex_unlock(&work_lock);
+
+	return 0;
+}
+
+void uloop_work_get_stats(struct uloop_work_stats *stats)
+{
+	pthread_mutex_lock(&work_lock);
+	*stats = work_stats;
+	pthread_mutex_unlock(&work_lock);
+}
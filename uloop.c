@@ -26,17 +26,37 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include "uloop.h"
 #include "utils.h"
+#include "ulog.h"
 
 #ifdef USE_KQUEUE
 #include <sys/event.h>
 #endif
 #ifdef USE_EPOLL
+#ifndef USE_IO_URING
 #include <sys/epoll.h>
 #endif
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#endif
 #include <sys/wait.h>
+#include <sys/syscall.h>
+
+#if defined(USE_EPOLL) && defined(__NR_pidfd_open)
+#define USE_PIDFD
+#endif
+
+#if defined(USE_EPOLL) && !defined(USE_IO_URING)
+#define USE_TIMERFD
+#define USE_EPOLL_BATCH
+#include <sys/timerfd.h>
+#endif
+
+#define NSEC_PER_MSEC	1000000LL
+#define NSEC_PER_SEC	1000000000LL
 
 struct uloop_fd_event {
 	struct uloop_fd *fd;
@@ -49,33 +69,149 @@ struct uloop_fd_stack {
 	unsigned int events;
 };
 
-static struct uloop_fd_stack *fd_stack = NULL;
-
 #define ULOOP_MAX_EVENTS 10
 
-static struct list_head timeouts = LIST_HEAD_INIT(timeouts);
-static struct list_head processes = LIST_HEAD_INIT(processes);
+/*
+ * Timeouts are kept in a hierarchical timer wheel with 1ms ticks.
+ * Every level has 64 slots, each slot of level n spans 64^n ticks.
+ * Timers are added to the lowest level that can hold their expiry and
+ * cascaded down one level at a time once their slot comes up, which
+ * keeps add, cancel and expiry O(1). Once their tick is reached, timers
+ * move to a list sorted by their exact expiry in nanoseconds.
+ */
+#define ULOOP_WHEEL_BITS	6
+#define ULOOP_WHEEL_SIZE	(1 << ULOOP_WHEEL_BITS)
+#define ULOOP_WHEEL_MASK	(ULOOP_WHEEL_SIZE - 1)
+#define ULOOP_WHEEL_LEVELS	6
+
+struct uloop_timer_wheel {
+	struct list_head slot[ULOOP_WHEEL_LEVELS][ULOOP_WHEEL_SIZE];
+	uint64_t pending[ULOOP_WHEEL_LEVELS];
+
+	/* timers within the current tick, sorted by expiry */
+	struct list_head expired;
+
+	/* last tick that has been fully processed */
+	int64_t now;
+	unsigned int count;
+	bool init;
+};
+
+struct uloop_ctx {
+	int poll_fd;
+#ifdef USE_IO_URING
+	struct uloop_uring *uring;
+#endif
+
+	struct uloop_fd_stack *fd_stack;
+
+	/* registered fds by fd number, detached again by uloop_ctx_done */
+	struct uloop_fd **fds;
+	int n_fds;
+	struct uloop_fd_event *cur_fds;
+	void *events;
+	int cur_fd, cur_nfds;
+	int max_events;
+
+	struct uloop_timer_wheel timeouts;
+
+	int waker_pipe;
+	struct uloop_fd waker_fd;
+
+	/* lock-free stack of posted calls, pushed by any thread */
+	struct uloop_post_entry *posted;
+	int held;
+
+	struct list_head deferred;
+
+#ifdef USE_TIMERFD
+	struct uloop_fd timer_fd;
+#endif
+
+#ifdef USE_EPOLL_BATCH
+	/* registered and wanted epoll events by fd number */
+	struct uloop_poll_reg *poll_regs;
+	int n_poll_regs;
+
+	/* fd numbers with queued changes */
+	int *poll_changes;
+	int n_poll_changes, poll_changes_size;
+#endif
+
+	struct uloop_stats stats;
+
+	/* busy polling: budget limit, average time between events (ns) */
+	int64_t busy_poll_max;
+	int64_t busy_poll_avg;
+	int64_t last_event;
+
+	/* open addressing hash of per callback statistics */
+	struct uloop_cb_stats *cb_stats;
+	unsigned int cb_stats_size, cb_stats_count;
+
+	int run_depth;
+	int status;
+	bool *cancelled;
+	bool cancel_flag;
+};
+
+static void waker_consume(struct uloop_fd *fd, unsigned int events);
 
-static int poll_fd = -1;
 bool uloop_cancelled = false;
 bool uloop_handle_sigchld = true;
-static int uloop_status = 0;
+bool uloop_batch_events = false;
+bool uloop_use_signalfd = false;
+bool uloop_use_timerfd = false;
+bool uloop_batch_fd_updates = false;
+bool uloop_instrument = false;
+unsigned int uloop_stall_threshold = 0;
 static bool do_sigchld = false;
 
-static struct uloop_fd_event cur_fds[ULOOP_MAX_EVENTS];
-static int cur_fd, cur_nfds;
-static int uloop_run_depth = 0;
+/* signals and child processes are only handled by the default context */
+static struct uloop_ctx default_ctx = {
+	.poll_fd = -1,
+	.max_events = ULOOP_MAX_EVENTS,
+	.waker_pipe = -1,
+	.waker_fd = {
+		.fd = -1,
+		.cb = waker_consume,
+	},
+#ifdef USE_TIMERFD
+	.timer_fd = { .fd = -1 },
+#endif
+	.deferred = LIST_HEAD_INIT(default_ctx.deferred),
+	.cancelled = &uloop_cancelled,
+};
+
+static __thread struct uloop_ctx *cur_ctx;
+
+static int uloop_pid_cmp(const void *k1, const void *k2, void *ptr)
+{
+	return *(const pid_t *) k1 - *(const pid_t *) k2;
+}
 
-int uloop_fd_add(struct uloop_fd *sock, unsigned int flags);
+static AVL_TREE(processes, uloop_pid_cmp, true, NULL);
+static int pidfd_processes;
 
 #ifdef USE_KQUEUE
 #include "uloop-kqueue.c"
 #endif
 
-#ifdef USE_EPOLL
+#if defined(USE_EPOLL) && defined(USE_IO_URING)
+#include "uloop-io_uring.c"
+#elif defined(USE_EPOLL)
 #include "uloop-epoll.c"
 #endif
 
+#ifdef USE_EPOLL
+static void waker_consume(struct uloop_fd *fd, unsigned int events)
+{
+	uint64_t val;
+
+	while (read(fd->fd, &val, sizeof(val)) < 0 && errno == EINTR)
+		;
+}
+#else
 static void waker_consume(struct uloop_fd *fd, unsigned int events)
 {
 	char buf[4];
@@ -83,48 +219,203 @@ static void waker_consume(struct uloop_fd *fd, unsigned int events)
 	while (read(fd->fd, buf, 4) > 0)
 		;
 }
+#endif
 
-static int waker_pipe = -1;
-static struct uloop_fd waker_fd = {
-	.fd = -1,
-	.cb = waker_consume,
-};
-
+#ifndef USE_EPOLL
 static void waker_init_fd(int fd)
 {
 	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 }
+#endif
 
-static int waker_init(void)
+static int waker_init(struct uloop_ctx *ctx)
 {
-	int fds[2];
-
-	if (waker_pipe >= 0)
+	if (ctx->waker_pipe >= 0)
 		return 0;
 
+#ifdef USE_EPOLL
+	/* a single eventfd serves as both ends of the waker */
+	ctx->waker_pipe = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ctx->waker_pipe < 0)
+		return -1;
+
+	ctx->waker_fd.fd = ctx->waker_pipe;
+#else
+	int fds[2];
+
 	if (pipe(fds) < 0)
 		return -1;
 
 	waker_init_fd(fds[0]);
 	waker_init_fd(fds[1]);
-	waker_pipe = fds[1];
+	ctx->waker_pipe = fds[1];
 
-	waker_fd.fd = fds[0];
-	waker_fd.cb = waker_consume;
-	uloop_fd_add(&waker_fd, ULOOP_READ);
+	ctx->waker_fd.fd = fds[0];
+#endif
+	ctx->waker_fd.cb = waker_consume;
+	uloop_ctx_fd_add(ctx, &ctx->waker_fd, ULOOP_READ);
 
 	return 0;
 }
 
+static void waker_done(struct uloop_ctx *ctx)
+{
+	if (ctx->waker_pipe < 0)
+		return;
+
+	uloop_fd_delete(&ctx->waker_fd);
+	if (ctx->waker_fd.fd != ctx->waker_pipe)
+		close(ctx->waker_fd.fd);
+	close(ctx->waker_pipe);
+	ctx->waker_pipe = -1;
+	ctx->waker_fd.fd = -1;
+}
+
+static void waker_wake(struct uloop_ctx *ctx)
+{
+#ifdef USE_EPOLL
+	uint64_t val = 1;
+#else
+	char val = 'w';
+#endif
+
+	do {
+		if (write(ctx->waker_pipe, &val, sizeof(val)) < 0) {
+			if (errno == EINTR)
+				continue;
+		}
+		break;
+	} while (1);
+}
+
+static int uloop_alloc_events(struct uloop_ctx *ctx, int n)
+{
+	struct uloop_fd_event *new_fds;
+	void *new_events;
+
+	/* only called with no fetched events pending, nothing to preserve */
+	new_fds = malloc(n * sizeof(*ctx->cur_fds));
+	new_events = malloc(n * ULOOP_POLL_EVENT_SIZE);
+	if (!new_fds || !new_events) {
+		free(new_fds);
+		free(new_events);
+		return -1;
+	}
+
+	free(ctx->cur_fds);
+	free(ctx->events);
+	ctx->cur_fds = new_fds;
+	ctx->events = new_events;
+	ctx->max_events = n;
+
+	return 0;
+}
+
+static void uloop_free_events(struct uloop_ctx *ctx)
+{
+	free(ctx->cur_fds);
+	free(ctx->events);
+	ctx->cur_fds = NULL;
+	ctx->events = NULL;
+	ctx->cur_fd = ctx->cur_nfds = 0;
+}
+
+int uloop_ctx_set_max_events(struct uloop_ctx *ctx, int n)
+{
+	if (n <= 0)
+		return -1;
+
+	/* cannot resize while fetched events are still being dispatched */
+	if (ctx->cur_nfds)
+		return -1;
+
+	if (!ctx->cur_fds) {
+		ctx->max_events = n;
+		return 0;
+	}
+
+	return uloop_alloc_events(ctx, n);
+}
+
+int uloop_set_max_events(int n)
+{
+	return uloop_ctx_set_max_events(uloop_ctx_current(), n);
+}
+
+int uloop_ctx_set_busy_poll(struct uloop_ctx *ctx, unsigned int usecs)
+{
+	ctx->busy_poll_max = usecs * 1000LL;
+	ctx->busy_poll_avg = ctx->busy_poll_max;
+	ctx->last_event = 0;
+
+	return 0;
+}
+
+int uloop_set_busy_poll(unsigned int usecs)
+{
+	return uloop_ctx_set_busy_poll(uloop_ctx_current(), usecs);
+}
+
+struct uloop_ctx *uloop_ctx_current(void)
+{
+	return cur_ctx ? cur_ctx : &default_ctx;
+}
+
+void uloop_ctx_set_current(struct uloop_ctx *ctx)
+{
+	cur_ctx = ctx;
+}
+
 static void uloop_setup_signals(bool add);
 
-int uloop_init(void)
+static int uloop_ctx_init(struct uloop_ctx *ctx)
 {
-	if (uloop_init_pollfd() < 0)
+	if (!ctx->cur_fds && uloop_alloc_events(ctx, ctx->max_events) < 0)
 		return -1;
 
-	if (waker_init() < 0) {
+	if (uloop_init_pollfd(ctx) < 0)
+		return -1;
+
+	if (waker_init(ctx) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void uloop_ctx_done(struct uloop_ctx *ctx);
+
+struct uloop_ctx *uloop_ctx_new(void)
+{
+	struct uloop_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->poll_fd = -1;
+	ctx->max_events = ULOOP_MAX_EVENTS;
+	ctx->waker_pipe = -1;
+	ctx->waker_fd.fd = -1;
+	ctx->waker_fd.cb = waker_consume;
+#ifdef USE_TIMERFD
+	ctx->timer_fd.fd = -1;
+#endif
+	INIT_LIST_HEAD(&ctx->deferred);
+	ctx->cancelled = &ctx->cancel_flag;
+
+	if (uloop_ctx_init(ctx) < 0) {
+		uloop_ctx_done(ctx);
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+int uloop_init(void)
+{
+	if (uloop_ctx_init(&default_ctx) < 0) {
 		uloop_done();
 		return -1;
 	}
@@ -134,7 +425,7 @@ int uloop_init(void)
 	return 0;
 }
 
-static bool uloop_fd_stack_event(struct uloop_fd *fd, int events)
+static bool uloop_fd_stack_event(struct uloop_ctx *ctx, struct uloop_fd *fd, int events)
 {
 	struct uloop_fd_stack *cur;
 
@@ -145,7 +436,7 @@ static bool uloop_fd_stack_event(struct uloop_fd *fd, int events)
 	if (!(fd->flags & ULOOP_EDGE_TRIGGER))
 		return false;
 
-	for (cur = fd_stack; cur; cur = cur->next) {
+	for (cur = ctx->fd_stack; cur; cur = cur->next) {
 		if (cur->fd != fd)
 			continue;
 
@@ -160,24 +451,198 @@ static bool uloop_fd_stack_event(struct uloop_fd *fd, int events)
 	return false;
 }
 
-static void uloop_run_events(int timeout)
+static int64_t uloop_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline int64_t uloop_instr_start(void)
+{
+	if (!uloop_instrument && !uloop_stall_threshold)
+		return 0;
+
+	return uloop_now_ns();
+}
+
+static struct uloop_cb_stats *
+uloop_cb_stats_slot(struct uloop_cb_stats *tbl, unsigned int size, const void *cb)
+{
+	unsigned int i = ((uintptr_t) cb >> 4) * 2654435761U;
+
+	for (i &= size - 1; tbl[i].cb && tbl[i].cb != cb; i = (i + 1) & (size - 1))
+		;
+
+	return &tbl[i];
+}
+
+static struct uloop_cb_stats *
+uloop_cb_stats_get(struct uloop_ctx *ctx, const void *cb)
+{
+	struct uloop_cb_stats *tbl, *s;
+	unsigned int i, size;
+
+	if (ctx->cb_stats_count * 2 >= ctx->cb_stats_size) {
+		size = ctx->cb_stats_size ? ctx->cb_stats_size * 2 : 64;
+		tbl = calloc(size, sizeof(*tbl));
+		if (!tbl)
+			return NULL;
+
+		for (i = 0; i < ctx->cb_stats_size; i++) {
+			if (!ctx->cb_stats[i].cb)
+				continue;
+
+			s = uloop_cb_stats_slot(tbl, size, ctx->cb_stats[i].cb);
+			*s = ctx->cb_stats[i];
+		}
+
+		free(ctx->cb_stats);
+		ctx->cb_stats = tbl;
+		ctx->cb_stats_size = size;
+	}
+
+	s = uloop_cb_stats_slot(ctx->cb_stats, ctx->cb_stats_size, cb);
+	if (!s->cb) {
+		s->cb = cb;
+		ctx->cb_stats_count++;
+	}
+
+	return s;
+}
+
+static void uloop_instr_done(struct uloop_ctx *ctx, int64_t start,
+			     int type, const void *cb)
+{
+	static const char * const types[] = {
+		[ULOOP_CB_FD] = "fd",
+		[ULOOP_CB_TIMEOUT] = "timeout",
+	};
+	struct uloop_cb_stats *s;
+	uint64_t delta;
+	int bucket;
+
+	delta = uloop_instr_start() - start;
+
+	if (uloop_stall_threshold && delta >= uloop_stall_threshold * 1000ULL)
+		ulog(LOG_WARNING, "uloop: %s callback %p blocked the loop for %llu us\n",
+		     types[type], cb, (unsigned long long) delta / 1000);
+
+	if (!uloop_instrument)
+		return;
+
+	s = uloop_cb_stats_get(ctx, cb);
+	if (!s)
+		return;
+
+	bucket = delta ? 64 - __builtin_clzll(delta) : 0;
+	if (bucket >= ULOOP_CB_STATS_BUCKETS)
+		bucket = ULOOP_CB_STATS_BUCKETS - 1;
+
+	s->type = type;
+	s->hist[bucket]++;
+	s->count++;
+	s->total += delta;
+	if (delta > s->max)
+		s->max = delta;
+}
+
+void uloop_ctx_foreach_cb_stats(struct uloop_ctx *ctx, uloop_cb_stats_handler fn, void *priv)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->cb_stats_size; i++)
+		if (ctx->cb_stats[i].cb)
+			fn(&ctx->cb_stats[i], priv);
+}
+
+void uloop_foreach_cb_stats(uloop_cb_stats_handler fn, void *priv)
+{
+	uloop_ctx_foreach_cb_stats(uloop_ctx_current(), fn, priv);
+}
+
+void uloop_ctx_reset_cb_stats(struct uloop_ctx *ctx)
+{
+	free(ctx->cb_stats);
+	ctx->cb_stats = NULL;
+	ctx->cb_stats_size = 0;
+	ctx->cb_stats_count = 0;
+}
+
+/*
+ * Poll without blocking for up to twice the average time between recent
+ * events (limited by busy_poll_max) before falling back to a blocking wait.
+ * Loops with events further apart than the limit do not spin at all.
+ */
+static int uloop_fetch_events_busy(struct uloop_ctx *ctx, int64_t timeout)
+{
+	int64_t budget = 2 * ctx->busy_poll_avg;
+	int64_t start, now, delta;
+	int nfds = 0;
+
+	if (budget > ctx->busy_poll_max)
+		budget = 0;
+	if (timeout >= 0 && budget > timeout)
+		budget = timeout;
+
+	now = start = uloop_now_ns();
+	if (budget > 0) {
+		do {
+			nfds = uloop_fetch_events(ctx, 0);
+			now = uloop_now_ns();
+		} while (nfds <= 0 && now - start < budget);
+
+		if (nfds > 0)
+			ctx->stats.busy_poll_hits++;
+		else
+			ctx->stats.busy_poll_misses++;
+	}
+
+	if (nfds <= 0) {
+		if (timeout > 0)
+			timeout = timeout > now - start ? timeout - (now - start) : 0;
+
+		nfds = uloop_fetch_events(ctx, timeout);
+		if (nfds <= 0)
+			return nfds;
+
+		now = uloop_now_ns();
+	}
+
+	if (ctx->last_event) {
+		delta = now - ctx->last_event;
+		ctx->busy_poll_avg += (delta - ctx->busy_poll_avg) / 8;
+	}
+	ctx->last_event = now;
+
+	return nfds;
+}
+
+static void uloop_run_events(struct uloop_ctx *ctx, int64_t timeout)
 {
 	struct uloop_fd_event *cur;
 	struct uloop_fd *fd;
+	uloop_fd_handler cb;
+	int64_t start;
 
-	if (!cur_nfds) {
-		cur_fd = 0;
-		cur_nfds = uloop_fetch_events(timeout);
-		if (cur_nfds < 0)
-			cur_nfds = 0;
+	if (!ctx->cur_nfds) {
+		ctx->cur_fd = 0;
+		if (ctx->busy_poll_max && timeout)
+			ctx->cur_nfds = uloop_fetch_events_busy(ctx, timeout);
+		else
+			ctx->cur_nfds = uloop_fetch_events(ctx, timeout);
+		ctx->stats.wakeups++;
+		if (ctx->cur_nfds < 0)
+			ctx->cur_nfds = 0;
 	}
 
-	while (cur_nfds > 0) {
+	while (ctx->cur_nfds > 0) {
 		struct uloop_fd_stack stack_cur;
 		unsigned int events;
 
-		cur = &cur_fds[cur_fd++];
-		cur_nfds--;
+		cur = &ctx->cur_fds[ctx->cur_fd++];
+		ctx->cur_nfds--;
 
 		fd = cur->fd;
 		events = cur->events;
@@ -187,24 +652,81 @@ static void uloop_run_events(int timeout)
 		if (!fd->cb)
 			continue;
 
-		if (uloop_fd_stack_event(fd, cur->events))
+		if (uloop_fd_stack_event(ctx, fd, cur->events))
 			continue;
 
-		stack_cur.next = fd_stack;
+		cb = fd->cb;
+		start = uloop_instr_start();
+
+		stack_cur.next = ctx->fd_stack;
 		stack_cur.fd = fd;
-		fd_stack = &stack_cur;
+		ctx->fd_stack = &stack_cur;
 		do {
 			stack_cur.events = 0;
 			fd->cb(fd, events);
 			events = stack_cur.events & ULOOP_EVENT_MASK;
 		} while (stack_cur.fd && events);
-		fd_stack = stack_cur.next;
+		ctx->fd_stack = stack_cur.next;
 
-		return;
+		if (start)
+			uloop_instr_done(ctx, start, ULOOP_CB_FD, (const void *) cb);
+
+		if (!uloop_batch_events || *ctx->cancelled)
+			return;
 	}
 }
 
-int uloop_fd_add(struct uloop_fd *sock, unsigned int flags)
+static int uloop_fd_track(struct uloop_ctx *ctx, struct uloop_fd *fd)
+{
+	struct uloop_fd **fds;
+	int n;
+
+	if (fd->fd < 0)
+		return -1;
+
+	if (fd->fd >= ctx->n_fds) {
+		n = ctx->n_fds ? ctx->n_fds : 64;
+		while (n <= fd->fd)
+			n *= 2;
+
+		fds = realloc(ctx->fds, n * sizeof(*fds));
+		if (!fds)
+			return -1;
+
+		memset(&fds[ctx->n_fds], 0, (n - ctx->n_fds) * sizeof(*fds));
+		ctx->fds = fds;
+		ctx->n_fds = n;
+	}
+
+	ctx->fds[fd->fd] = fd;
+	return 0;
+}
+
+static void uloop_fd_untrack(struct uloop_ctx *ctx, struct uloop_fd *fd)
+{
+	if (fd->fd >= 0 && fd->fd < ctx->n_fds && ctx->fds[fd->fd] == fd)
+		ctx->fds[fd->fd] = NULL;
+}
+
+/* fds still registered when a context goes away must not point to it */
+static void uloop_clear_fds(struct uloop_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->n_fds; i++) {
+		if (!ctx->fds[i])
+			continue;
+
+		ctx->fds[i]->registered = false;
+		ctx->fds[i]->ctx = NULL;
+	}
+
+	free(ctx->fds);
+	ctx->fds = NULL;
+	ctx->n_fds = 0;
+}
+
+int uloop_ctx_fd_add(struct uloop_ctx *ctx, struct uloop_fd *sock, unsigned int flags)
 {
 	unsigned int fl;
 	int ret;
@@ -212,16 +734,41 @@ int uloop_fd_add(struct uloop_fd *sock, unsigned int flags)
 	if (!(flags & (ULOOP_READ | ULOOP_WRITE | ULOOP_PRIORITY)))
 		return uloop_fd_delete(sock);
 
-	if (!sock->registered && !(flags & ULOOP_BLOCKING)) {
+	/* moving to a different context */
+	if (sock->registered && sock->ctx != ctx)
+		uloop_fd_delete(sock);
+
+	/* edge triggered fds rely on the modification to be re-armed */
+	if (sock->registered && sock->flags == flags &&
+	    !(flags & ULOOP_EDGE_TRIGGER)) {
+		ctx->stats.fd_syscalls_saved++;
+		sock->eof = false;
+		sock->error = false;
+		return 0;
+	}
+
+	/* only check O_NONBLOCK on the first add or when ULOOP_BLOCKING is dropped */
+	if (!(flags & ULOOP_BLOCKING) &&
+	    (!sock->registered || (sock->flags & ULOOP_BLOCKING))) {
 		fl = fcntl(sock->fd, F_GETFL, 0);
-		fl |= O_NONBLOCK;
-		fcntl(sock->fd, F_SETFL, fl);
+		ctx->stats.fd_syscalls++;
+		if (!(fl & O_NONBLOCK)) {
+			fcntl(sock->fd, F_SETFL, fl | O_NONBLOCK);
+			ctx->stats.fd_syscalls++;
+		}
 	}
 
-	ret = register_poll(sock, flags);
-	if (ret < 0)
+	if (!sock->registered && uloop_fd_track(ctx, sock) < 0)
+		return -1;
+
+	ret = register_poll(ctx, sock, flags);
+	if (ret < 0) {
+		if (!sock->registered)
+			uloop_fd_untrack(ctx, sock);
 		goto out;
+	}
 
+	sock->ctx = ctx;
 	sock->registered = true;
 	sock->eof = false;
 	sock->error = false;
@@ -230,123 +777,420 @@ out:
 	return ret;
 }
 
+int uloop_fd_add(struct uloop_fd *sock, unsigned int flags)
+{
+	struct uloop_ctx *ctx = sock->registered ? sock->ctx : uloop_ctx_current();
+
+	return uloop_ctx_fd_add(ctx, sock, flags);
+}
+
 int uloop_fd_delete(struct uloop_fd *fd)
 {
+	struct uloop_ctx *ctx = fd->ctx;
 	int i;
 
-	for (i = 0; i < cur_nfds; i++) {
-		if (cur_fds[cur_fd + i].fd != fd)
+	if (!fd->registered || !ctx)
+		return 0;
+
+	for (i = 0; i < ctx->cur_nfds; i++) {
+		if (ctx->cur_fds[ctx->cur_fd + i].fd != fd)
 			continue;
 
-		cur_fds[cur_fd + i].fd = NULL;
+		ctx->cur_fds[ctx->cur_fd + i].fd = NULL;
 	}
 
-	if (!fd->registered)
-		return 0;
-
+	uloop_fd_untrack(ctx, fd);
 	fd->registered = false;
-	uloop_fd_stack_event(fd, -1);
-	return __uloop_fd_delete(fd);
+	uloop_fd_stack_event(ctx, fd, -1);
+	return __uloop_fd_delete(ctx, fd);
+}
+
+#ifndef USE_IO_URING
+int uloop_io_read(struct uloop_io *io, int fd, void *buf, size_t len)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int uloop_io_write(struct uloop_io *io, int fd, const void *buf, size_t len)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int uloop_io_cancel(struct uloop_io *io)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+static int64_t ts_nsecs(struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static int64_t ts_ticks(struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * 1000 + ts->tv_nsec / NSEC_PER_MSEC;
+}
+
+static void uloop_expired_insert(struct uloop_timer_wheel *w, struct uloop_timeout *t)
+{
+	int64_t expires = ts_nsecs(&t->deadline);
+	struct uloop_timeout *tmp;
+	struct list_head *h = &w->expired;
+
+	/* timers are mostly added in order, search from the end */
+	list_for_each_entry_reverse(tmp, &w->expired, list) {
+		if (ts_nsecs(&tmp->deadline) <= expires)
+			break;
+
+		h = &tmp->list;
+	}
+
+	list_add_tail(&t->list, h);
+}
+
+static void uloop_wheel_init(struct uloop_timer_wheel *w)
+{
+	int i, j;
+
+	for (i = 0; i < ULOOP_WHEEL_LEVELS; i++)
+		for (j = 0; j < ULOOP_WHEEL_SIZE; j++)
+			INIT_LIST_HEAD(&w->slot[i][j]);
+
+	INIT_LIST_HEAD(&w->expired);
+	w->init = true;
+}
+
+static void uloop_wheel_insert(struct uloop_timer_wheel *w, struct uloop_timeout *t)
+{
+	int64_t expires = ts_ticks(&t->deadline);
+	int lvl, shift, idx;
+
+	if (expires <= w->now) {
+		uloop_expired_insert(w, t);
+		return;
+	}
+
+	for (lvl = 0; lvl < ULOOP_WHEEL_LEVELS - 1; lvl++) {
+		shift = lvl * ULOOP_WHEEL_BITS;
+		if ((expires >> shift) - (w->now >> shift) <= ULOOP_WHEEL_SIZE)
+			break;
+	}
+
+	/* beyond the range of the last level, cascade again later */
+	shift = lvl * ULOOP_WHEEL_BITS;
+	if ((expires >> shift) - (w->now >> shift) > ULOOP_WHEEL_SIZE)
+		expires = ((w->now >> shift) + ULOOP_WHEEL_SIZE) << shift;
+
+	idx = (expires >> shift) & ULOOP_WHEEL_MASK;
+	list_add_tail(&t->list, &w->slot[lvl][idx]);
+	w->pending[lvl] |= 1ULL << idx;
+}
+
+static void uloop_wheel_del(struct uloop_timer_wheel *w, struct uloop_timeout *t)
+{
+	struct list_head *first = &w->slot[0][0];
+	struct list_head *head = t->list.next;
+	int n;
+
+	/* last entry of a slot, clear its pending bit */
+	if (head == t->list.prev && head >= first &&
+	    head < first + ULOOP_WHEEL_LEVELS * ULOOP_WHEEL_SIZE) {
+		n = head - first;
+		w->pending[n / ULOOP_WHEEL_SIZE] &= ~(1ULL << (n % ULOOP_WHEEL_SIZE));
+	}
+
+	list_del(&t->list);
+}
+
+/* returns the next tick at which a slot expires or needs to be cascaded */
+static int64_t uloop_wheel_next(struct uloop_timer_wheel *w)
+{
+	int64_t next = -1, cur, idx;
+	uint64_t bits;
+	int lvl, shift, ofs;
+
+	for (lvl = 0; lvl < ULOOP_WHEEL_LEVELS; lvl++) {
+		bits = w->pending[lvl];
+		if (!bits)
+			continue;
+
+		shift = lvl * ULOOP_WHEEL_BITS;
+		idx = (w->now >> shift) + 1;
+		ofs = idx & ULOOP_WHEEL_MASK;
+		if (ofs)
+			bits = (bits >> ofs) | (bits << (ULOOP_WHEEL_SIZE - ofs));
+
+		cur = (idx + __builtin_ctzll(bits)) << shift;
+		if (next < 0 || cur < next)
+			next = cur;
+	}
+
+	return next;
+}
+
+/* move the wheel to just before tick, returns the level 0 slot due at tick */
+static struct list_head *uloop_wheel_advance(struct uloop_timer_wheel *w, int64_t tick)
+{
+	struct uloop_timeout *t, *tmp;
+	struct list_head list;
+	int lvl, shift, idx;
+
+	if (w->now < tick - 1)
+		w->now = tick - 1;
+
+	for (lvl = ULOOP_WHEEL_LEVELS - 1; lvl > 0; lvl--) {
+		shift = lvl * ULOOP_WHEEL_BITS;
+		if (tick & ((1LL << shift) - 1))
+			continue;
+
+		idx = (tick >> shift) & ULOOP_WHEEL_MASK;
+		if (!(w->pending[lvl] & (1ULL << idx)))
+			continue;
+
+		INIT_LIST_HEAD(&list);
+		list_splice_init(&w->slot[lvl][idx], &list);
+		w->pending[lvl] &= ~(1ULL << idx);
+
+		list_for_each_entry_safe(t, tmp, &list, list)
+			uloop_wheel_insert(w, t);
+	}
+
+	return &w->slot[0][tick & ULOOP_WHEEL_MASK];
+}
+
+/*
+ * Round the expiry up to a multiple of the largest power of two (in ms)
+ * that fits into the slack, so that timers with slack share expiry points
+ */
+static void uloop_timeout_round(struct uloop_timeout *t)
+{
+	struct timespec *time = &t->deadline;
+	int64_t expires, gran;
+
+	if (!t->slack)
+		return;
+
+	gran = (1LL << (31 - __builtin_clz(t->slack))) * NSEC_PER_MSEC;
+	expires = ts_nsecs(time) + gran - 1;
+	expires -= expires % gran;
+
+	time->tv_sec = expires / NSEC_PER_SEC;
+	time->tv_nsec = expires % NSEC_PER_SEC;
+}
+
+int uloop_ctx_timeout_add(struct uloop_ctx *ctx, struct uloop_timeout *timeout)
+{
+	struct uloop_timer_wheel *w = &ctx->timeouts;
+
+	if (timeout->pending)
+		return -1;
+
+	if (!w->init)
+		uloop_wheel_init(w);
+
+	uloop_timeout_round(timeout);
+	timeout->time.tv_sec = timeout->deadline.tv_sec;
+	timeout->time.tv_usec = timeout->deadline.tv_nsec / 1000;
+
+	uloop_wheel_insert(w, timeout);
+	w->count++;
+	timeout->ctx = ctx;
+	timeout->pending = true;
+
+	return 0;
+}
+
+int uloop_timeout_add(struct uloop_timeout *timeout)
+{
+	return uloop_ctx_timeout_add(uloop_ctx_current(), timeout);
+}
+
+static void uloop_gettime(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+int uloop_ctx_timeout_set_ns(struct uloop_ctx *ctx, struct uloop_timeout *timeout, int64_t nsecs)
+{
+	struct timespec *time = &timeout->deadline;
+
+	if (timeout->pending)
+		uloop_timeout_cancel(timeout);
+
+	uloop_gettime(time);
+
+	time->tv_sec += nsecs / NSEC_PER_SEC;
+	time->tv_nsec += nsecs % NSEC_PER_SEC;
+
+	if (time->tv_nsec >= NSEC_PER_SEC) {
+		time->tv_sec++;
+		time->tv_nsec -= NSEC_PER_SEC;
+	} else if (time->tv_nsec < 0) {
+		time->tv_sec--;
+		time->tv_nsec += NSEC_PER_SEC;
+	}
+
+	return uloop_ctx_timeout_add(ctx, timeout);
+}
+
+int uloop_ctx_timeout_set(struct uloop_ctx *ctx, struct uloop_timeout *timeout, int msecs)
+{
+	return uloop_ctx_timeout_set_ns(ctx, timeout, msecs * NSEC_PER_MSEC);
+}
+
+int uloop_timeout_set(struct uloop_timeout *timeout, int msecs)
+{
+	return uloop_ctx_timeout_set_ns(uloop_ctx_current(), timeout, msecs * NSEC_PER_MSEC);
+}
+
+int uloop_timeout_set_us(struct uloop_timeout *timeout, int64_t usecs)
+{
+	return uloop_ctx_timeout_set_ns(uloop_ctx_current(), timeout, usecs * 1000);
 }
 
-static int tv_diff(struct timeval *t1, struct timeval *t2)
+int uloop_timeout_set_ns(struct uloop_timeout *timeout, int64_t nsecs)
 {
-	return
-		(t1->tv_sec - t2->tv_sec) * 1000 +
-		(t1->tv_usec - t2->tv_usec) / 1000;
+	return uloop_ctx_timeout_set_ns(uloop_ctx_current(), timeout, nsecs);
 }
 
-int uloop_timeout_add(struct uloop_timeout *timeout)
+int uloop_timeout_cancel(struct uloop_timeout *timeout)
 {
-	struct uloop_timeout *tmp;
-	struct list_head *h = &timeouts;
-
-	if (timeout->pending)
+	if (!timeout->pending)
 		return -1;
 
-	list_for_each_entry(tmp, &timeouts, list) {
-		if (tv_diff(&tmp->time, &timeout->time) > 0) {
-			h = &tmp->list;
-			break;
-		}
-	}
-
-	list_add_tail(&timeout->list, h);
-	timeout->pending = true;
+	uloop_wheel_del(&timeout->ctx->timeouts, timeout);
+	timeout->ctx->timeouts.count--;
+	timeout->pending = false;
 
 	return 0;
 }
 
-static void uloop_gettime(struct timeval *tv)
+int64_t uloop_timeout_remaining_ns(struct uloop_timeout *timeout)
 {
-	struct timespec ts;
+	struct timespec now;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	tv->tv_sec = ts.tv_sec;
-	tv->tv_usec = ts.tv_nsec / 1000;
+	if (!timeout->pending)
+		return -1;
+
+	uloop_gettime(&now);
+
+	return ts_nsecs(&timeout->deadline) - ts_nsecs(&now);
 }
 
-int uloop_timeout_set(struct uloop_timeout *timeout, int msecs)
+int uloop_timeout_remaining(struct uloop_timeout *timeout)
 {
-	struct timeval *time = &timeout->time;
+	int64_t rem = uloop_timeout_remaining_ns(timeout);
 
-	if (timeout->pending)
-		uloop_timeout_cancel(timeout);
+	if (!timeout->pending)
+		return -1;
 
-	uloop_gettime(time);
+	rem /= NSEC_PER_MSEC;
+	if (rem > INT_MAX)
+		return INT_MAX;
 
-	time->tv_sec += msecs / 1000;
-	time->tv_usec += (msecs % 1000) * 1000;
+	if (rem < INT_MIN)
+		return INT_MIN;
 
-	if (time->tv_usec > 1000000) {
-		time->tv_sec++;
-		time->tv_usec -= 1000000;
+	return rem;
+}
+
+static void uloop_process_dispatch(pid_t pid, int ret)
+{
+	struct uloop_process *p;
+
+	while ((p = avl_find_element(&processes, &pid, p, avl)) != NULL) {
+		uloop_process_delete(p);
+		p->cb(p, ret);
 	}
+}
+
+static void uloop_process_pidfd_close(struct uloop_process *p)
+{
+	if (p->pidfd.fd < 0)
+		return;
 
-	return uloop_timeout_add(timeout);
+	uloop_fd_delete(&p->pidfd);
+	close(p->pidfd.fd);
+	p->pidfd.fd = -1;
+	pidfd_processes--;
 }
 
-int uloop_timeout_cancel(struct uloop_timeout *timeout)
+#ifdef USE_PIDFD
+static void uloop_process_pidfd_cb(struct uloop_fd *fd, unsigned int events)
 {
-	if (!timeout->pending)
-		return -1;
+	struct uloop_process *p = container_of(fd, struct uloop_process, pidfd);
+	pid_t pid;
+	int ret;
 
-	list_del(&timeout->list);
-	timeout->pending = false;
+	do {
+		pid = waitpid(p->pid, &ret, WNOHANG);
+	} while (pid < 0 && errno == EINTR);
 
-	return 0;
+	if (!pid)
+		return;
+
+	if (pid < 0) {
+		/* reaped by someone else, stop watching it */
+		uloop_process_pidfd_close(p);
+		return;
+	}
+
+	uloop_process_dispatch(pid, ret);
+
+	/* other children may have been skipped while this one was pending */
+	if (uloop_handle_sigchld)
+		do_sigchld = true;
 }
 
-int uloop_timeout_remaining(struct uloop_timeout *timeout)
+static void uloop_process_pidfd_open(struct uloop_process *p)
 {
-	struct timeval now;
+	static bool unsupported;
+	int fd;
 
-	if (!timeout->pending)
-		return -1;
+	if (unsupported || default_ctx.poll_fd < 0)
+		return;
 
-	uloop_gettime(&now);
+	fd = syscall(__NR_pidfd_open, p->pid, 0);
+	if (fd < 0) {
+		if (errno == ENOSYS)
+			unsupported = true;
+		return;
+	}
+
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	p->pidfd.fd = fd;
+	p->pidfd.cb = uloop_process_pidfd_cb;
+	if (uloop_ctx_fd_add(&default_ctx, &p->pidfd, ULOOP_READ | ULOOP_ERROR_CB) < 0) {
+		close(fd);
+		p->pidfd.fd = -1;
+		return;
+	}
 
-	return tv_diff(&timeout->time, &now);
+	pidfd_processes++;
+}
+#else
+static void uloop_process_pidfd_open(struct uloop_process *p)
+{
 }
+#endif
 
 int uloop_process_add(struct uloop_process *p)
 {
-	struct uloop_process *tmp;
-	struct list_head *h = &processes;
-
 	if (p->pending)
 		return -1;
 
-	list_for_each_entry(tmp, &processes, list) {
-		if (tmp->pid > p->pid) {
-			h = &tmp->list;
-			break;
-		}
-	}
-
-	list_add_tail(&p->list, h);
+	p->avl.key = &p->pid;
+	avl_insert(&processes, &p->avl);
 	p->pending = true;
 
+	p->pidfd.registered = false;
+	p->pidfd.fd = -1;
+	uloop_process_pidfd_open(p);
+
 	return 0;
 }
 
@@ -355,64 +1199,72 @@ int uloop_process_delete(struct uloop_process *p)
 	if (!p->pending)
 		return -1;
 
-	list_del(&p->list);
+	uloop_process_pidfd_close(p);
+	avl_delete(&processes, &p->avl);
 	p->pending = false;
 
 	return 0;
 }
 
+static pid_t uloop_reap_next(int *ret)
+{
+	struct uloop_process *p;
+	siginfo_t info;
+	pid_t pid;
+
+	if (!pidfd_processes)
+		return waitpid(-1, ret, WNOHANG);
+
+	/*
+	 * Leave children with a pidfd to their own handler, only reap
+	 * untracked children and those without a pidfd here.
+	 */
+	memset(&info, 0, sizeof(info));
+	if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0)
+		return -1;
+
+	pid = info.si_pid;
+	if (!pid)
+		return 0;
+
+	p = avl_find_element(&processes, &pid, p, avl);
+	if (p && p->pidfd.fd >= 0)
+		return 0;
+
+	return waitpid(pid, ret, WNOHANG);
+}
+
 static void uloop_handle_processes(void)
 {
-	struct uloop_process *p, *tmp;
 	pid_t pid;
 	int ret;
 
 	do_sigchld = false;
 
 	while (1) {
-		pid = waitpid(-1, &ret, WNOHANG);
+		pid = uloop_reap_next(&ret);
 		if (pid < 0 && errno == EINTR)
 			continue;
 
 		if (pid <= 0)
 			return;
 
-		list_for_each_entry_safe(p, tmp, &processes, list) {
-			if (p->pid < pid)
-				continue;
-
-			if (p->pid > pid)
-				break;
-
-			uloop_process_delete(p);
-			p->cb(p, ret);
-		}
+		uloop_process_dispatch(pid, ret);
 	}
 
 }
 
-static void uloop_signal_wake(void)
-{
-	do {
-		if (write(waker_pipe, "w", 1) < 0) {
-			if (errno == EINTR)
-				continue;
-		}
-		break;
-	} while (1);
-}
-
 static void uloop_handle_sigint(int signo)
 {
-	uloop_status = signo;
+	default_ctx.status = signo;
 	uloop_cancelled = true;
-	uloop_signal_wake();
+	waker_wake(&default_ctx);
 }
 
 static void uloop_sigchld(int signo)
 {
 	do_sigchld = true;
-	uloop_signal_wake();
+	waker_wake(&default_ctx);
 }
 
 static void uloop_install_handler(int signum, void (*handler)(int), struct sigaction* old, bool add)
@@ -461,124 +1313,465 @@ static void uloop_ignore_signal(int signum, bool ignore)
 	}
 }
 
+#ifdef USE_EPOLL
+static sigset_t signalfd_mask;
+
+static void uloop_signalfd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct signalfd_siginfo si;
+
+	while (read(fd->fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGCHLD) {
+			do_sigchld = true;
+			continue;
+		}
+
+		default_ctx.status = si.ssi_signo;
+		uloop_cancelled = true;
+	}
+}
+
+static struct uloop_fd signal_fd = {
+	.fd = -1,
+	.cb = uloop_signalfd_cb,
+};
+
+static void uloop_signalfd_add(sigset_t *mask, sigset_t *blocked, int signum)
+{
+	struct sigaction s;
+
+	/* Do not take over signals with custom handlers or blocked by the caller */
+	sigaction(signum, NULL, &s);
+	if (s.sa_handler != SIG_DFL || sigismember(blocked, signum))
+		return;
+
+	sigaddset(mask, signum);
+}
+
+static bool uloop_setup_signalfd(bool add)
+{
+	sigset_t blocked;
+
+	if (!add) {
+		if (signal_fd.fd < 0)
+			return false;
+
+		uloop_fd_delete(&signal_fd);
+		/* consume signals received since the last iteration */
+		uloop_signalfd_cb(&signal_fd, ULOOP_READ);
+		close(signal_fd.fd);
+		signal_fd.fd = -1;
+		sigprocmask(SIG_UNBLOCK, &signalfd_mask, NULL);
+		return true;
+	}
+
+	if (!uloop_use_signalfd || signal_fd.fd >= 0)
+		return signal_fd.fd >= 0;
+
+	sigemptyset(&signalfd_mask);
+	sigprocmask(SIG_BLOCK, NULL, &blocked);
+	uloop_signalfd_add(&signalfd_mask, &blocked, SIGINT);
+	uloop_signalfd_add(&signalfd_mask, &blocked, SIGTERM);
+	if (uloop_handle_sigchld)
+		uloop_signalfd_add(&signalfd_mask, &blocked, SIGCHLD);
+
+	signal_fd.fd = signalfd(-1, &signalfd_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd.fd < 0)
+		return false;
+
+	sigprocmask(SIG_BLOCK, &signalfd_mask, NULL);
+	uloop_ctx_fd_add(&default_ctx, &signal_fd, ULOOP_READ);
+
+	return true;
+}
+#else
+static bool uloop_setup_signalfd(bool add)
+{
+	return false;
+}
+#endif
+
 static void uloop_setup_signals(bool add)
 {
 	static struct sigaction old_sigint, old_sigchld, old_sigterm;
 
-	uloop_install_handler(SIGINT, uloop_handle_sigint, &old_sigint, add);
-	uloop_install_handler(SIGTERM, uloop_handle_sigint, &old_sigterm, add);
+	if (!uloop_setup_signalfd(add)) {
+		uloop_install_handler(SIGINT, uloop_handle_sigint, &old_sigint, add);
+		uloop_install_handler(SIGTERM, uloop_handle_sigint, &old_sigterm, add);
 
-	if (uloop_handle_sigchld)
-		uloop_install_handler(SIGCHLD, uloop_sigchld, &old_sigchld, add);
+		if (uloop_handle_sigchld)
+			uloop_install_handler(SIGCHLD, uloop_sigchld, &old_sigchld, add);
+	}
 
 	uloop_ignore_signal(SIGPIPE, add);
 }
 
-static int uloop_get_next_timeout(struct timeval *tv)
+int uloop_ctx_defer_add(struct uloop_ctx *ctx, struct uloop_defer *d)
+{
+	if (d->pending)
+		return -1;
+
+	list_add_tail(&d->list, &ctx->deferred);
+	d->ctx = ctx;
+	d->pending = true;
+
+	return 0;
+}
+
+int uloop_defer_add(struct uloop_defer *d)
+{
+	return uloop_ctx_defer_add(uloop_ctx_current(), d);
+}
+
+int uloop_defer_cancel(struct uloop_defer *d)
+{
+	if (!d->pending)
+		return -1;
+
+	list_del(&d->list);
+	d->pending = false;
+	d->ctx = NULL;
+
+	return 0;
+}
+
+/* calls deferred while running these are left for the next iteration */
+static void uloop_run_deferred(struct uloop_ctx *ctx)
+{
+	struct uloop_defer *d;
+	struct list_head list;
+
+	INIT_LIST_HEAD(&list);
+	list_splice_init(&ctx->deferred, &list);
+	while (!list_empty(&list)) {
+		d = list_first_entry(&list, struct uloop_defer, list);
+		uloop_defer_cancel(d);
+		if (d->cb)
+			d->cb(d);
+	}
+}
+
+static void uloop_clear_deferred(struct uloop_ctx *ctx)
+{
+	struct uloop_defer *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, &ctx->deferred, list)
+		uloop_defer_cancel(d);
+}
+
+/* returns the time until the next timeout in nanoseconds, or -1 */
+static int64_t uloop_get_next_timeout(struct uloop_ctx *ctx, struct timespec *ts)
 {
-	struct uloop_timeout *timeout;
-	int diff;
+	struct uloop_timer_wheel *w = &ctx->timeouts;
+	struct uloop_timeout *t;
+	int64_t diff;
 
-	if (list_empty(&timeouts))
+	if (!list_empty(&ctx->deferred))
+		return 0;
+
+	if (!w->count)
 		return -1;
 
-	timeout = list_first_entry(&timeouts, struct uloop_timeout, list);
-	diff = tv_diff(&timeout->time, tv);
+	if (!list_empty(&w->expired)) {
+		t = list_first_entry(&w->expired, struct uloop_timeout, list);
+		diff = ts_nsecs(&t->deadline) - ts_nsecs(ts);
+	} else {
+		diff = uloop_wheel_next(w) * NSEC_PER_MSEC - ts_nsecs(ts);
+	}
+
 	if (diff < 0)
 		return 0;
 
 	return diff;
 }
 
-static void uloop_process_timeouts(struct timeval *tv)
+static void uloop_process_timeouts(struct uloop_ctx *ctx, struct timespec *ts)
 {
-	struct uloop_timeout *t;
+	struct uloop_timer_wheel *w = &ctx->timeouts;
+	int64_t tick = ts_ticks(ts);
+	int64_t now = ts_nsecs(ts);
+	struct uloop_timeout *t, *tmp;
+	struct list_head *h, list;
+	uloop_timeout_handler cb;
+	int64_t next, start;
+	int fired = 0;
+
+	while (w->count) {
+		next = uloop_wheel_next(w);
+		if (next >= 0 && next <= tick) {
+			h = uloop_wheel_advance(w, next);
+			w->pending[0] &= ~(1ULL << (next & ULOOP_WHEEL_MASK));
+			w->now = next;
+
+			INIT_LIST_HEAD(&list);
+			list_splice_init(h, &list);
+			list_for_each_entry_safe(t, tmp, &list, list)
+				uloop_expired_insert(w, t);
+			continue;
+		}
 
-	while (!list_empty(&timeouts)) {
-		t = list_first_entry(&timeouts, struct uloop_timeout, list);
+		if (list_empty(&w->expired))
+			break;
 
-		if (tv_diff(&t->time, tv) > 0)
+		t = list_first_entry(&w->expired, struct uloop_timeout, list);
+		if (ts_nsecs(&t->deadline) > now)
 			break;
 
+		/* a timer with slack that did not need a wakeup of its own */
+		if (fired++ && t->slack)
+			ctx->stats.timeouts_coalesced++;
+		ctx->stats.timeouts++;
+
 		uloop_timeout_cancel(t);
-		if (t->cb)
-			t->cb(t);
+		if (!t->cb)
+			continue;
+
+		cb = t->cb;
+		start = uloop_instr_start();
+		t->cb(t);
+		if (start)
+			uloop_instr_done(ctx, start, ULOOP_CB_TIMEOUT, (const void *) cb);
 	}
+
+	if (w->now < tick)
+		w->now = tick;
 }
 
-static void uloop_clear_timeouts(void)
+static void uloop_clear_timeouts(struct uloop_ctx *ctx)
 {
+	struct uloop_timer_wheel *w = &ctx->timeouts;
 	struct uloop_timeout *t, *tmp;
+	int i, j;
+
+	if (!w->init)
+		return;
 
-	list_for_each_entry_safe(t, tmp, &timeouts, list)
+	list_for_each_entry_safe(t, tmp, &w->expired, list) {
 		uloop_timeout_cancel(t);
+		t->ctx = NULL;
+	}
+
+	for (i = 0; i < ULOOP_WHEEL_LEVELS; i++)
+		for (j = 0; j < ULOOP_WHEEL_SIZE; j++)
+			list_for_each_entry_safe(t, tmp, &w->slot[i][j], list) {
+				uloop_timeout_cancel(t);
+				t->ctx = NULL;
+			}
 }
 
 static void uloop_clear_processes(void)
 {
 	struct uloop_process *p, *tmp;
 
-	list_for_each_entry_safe(p, tmp, &processes, list)
+	avl_for_each_element_safe(&processes, p, avl, tmp)
 		uloop_process_delete(p);
 }
 
+bool uloop_ctx_cancelling(struct uloop_ctx *ctx)
+{
+	return ctx->run_depth > 0 && *ctx->cancelled;
+}
+
 bool uloop_cancelling(void)
 {
-	return uloop_run_depth > 0 && uloop_cancelled;
+	return uloop_ctx_cancelling(uloop_ctx_current());
 }
 
-int uloop_run_timeout(int timeout)
+void uloop_ctx_end(struct uloop_ctx *ctx)
+{
+	*ctx->cancelled = true;
+	if (ctx != uloop_ctx_current())
+		waker_wake(ctx);
+}
+
+void uloop_ctx_wake(struct uloop_ctx *ctx)
+{
+	waker_wake(ctx);
+}
+
+/*
+ * Producers push onto a lock-free stack, only the one that finds it empty
+ * needs to wake up the loop. The loop takes the whole stack at once and
+ * reverses it to run the calls in the order they were posted.
+ */
+void uloop_post_entry_add(struct uloop_ctx *ctx, struct uloop_post_entry *e)
+{
+	struct uloop_post_entry *head;
+
+	head = __atomic_load_n(&ctx->posted, __ATOMIC_RELAXED);
+	do {
+		e->next = head;
+	} while (!__atomic_compare_exchange_n(&ctx->posted, &head, e, true,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (!head)
+		waker_wake(ctx);
+}
+
+int uloop_post(struct uloop_ctx *ctx, uloop_post_handler fn, void *arg)
+{
+	struct uloop_post_entry *e;
+
+	e = malloc(sizeof(*e));
+	if (!e)
+		return -1;
+
+	e->fn = fn;
+	e->arg = arg;
+	e->alloc = true;
+	uloop_post_entry_add(ctx, e);
+
+	return 0;
+}
+
+static struct uloop_post_entry *uloop_take_posted(struct uloop_ctx *ctx)
+{
+	struct uloop_post_entry *e, *next, *list = NULL;
+
+	e = __atomic_exchange_n(&ctx->posted, NULL, __ATOMIC_ACQUIRE);
+	while (e) {
+		next = e->next;
+		e->next = list;
+		list = e;
+		e = next;
+	}
+
+	return list;
+}
+
+static void uloop_run_posted(struct uloop_ctx *ctx)
+{
+	struct uloop_post_entry *e, *next;
+	bool alloc;
+
+	for (e = uloop_take_posted(ctx); e; e = next) {
+		/* fn may free a caller provided entry */
+		next = e->next;
+		alloc = e->alloc;
+		ctx->stats.posts++;
+		e->fn(e->arg);
+		if (alloc)
+			free(e);
+	}
+}
+
+static void uloop_clear_posted(struct uloop_ctx *ctx)
+{
+	struct uloop_post_entry *e, *next;
+
+	for (e = uloop_take_posted(ctx); e; e = next) {
+		next = e->next;
+		if (e->alloc)
+			free(e);
+	}
+}
+
+const struct uloop_stats *uloop_ctx_get_stats(struct uloop_ctx *ctx)
+{
+	return &ctx->stats;
+}
+
+const struct uloop_stats *uloop_get_stats(void)
+{
+	return uloop_ctx_get_stats(uloop_ctx_current());
+}
+
+int uloop_ctx_run_timeout(struct uloop_ctx *ctx, int timeout)
 {
-	int next_time = 0;
-	struct timeval tv;
+	struct uloop_ctx *prev_ctx = cur_ctx;
+	int64_t next_time = 0;
+	struct timespec ts;
 
-	uloop_run_depth++;
+	cur_ctx = ctx;
+	ctx->run_depth++;
 
-	uloop_status = 0;
-	uloop_cancelled = false;
-	while (!uloop_cancelled)
+	ctx->status = 0;
+	*ctx->cancelled = false;
+	while (!*ctx->cancelled)
 	{
-		uloop_gettime(&tv);
-		uloop_process_timeouts(&tv);
+		if (__atomic_load_n(&ctx->posted, __ATOMIC_RELAXED))
+			uloop_run_posted(ctx);
+
+		uloop_gettime(&ts);
+		uloop_process_timeouts(ctx, &ts);
 
-		if (do_sigchld)
+		if (do_sigchld && ctx == &default_ctx)
 			uloop_handle_processes();
 
-		if (uloop_cancelled)
+		if (!list_empty(&ctx->deferred))
+			uloop_run_deferred(ctx);
+
+		if (*ctx->cancelled)
 			break;
 
-		uloop_gettime(&tv);
+		uloop_gettime(&ts);
 
-		next_time = uloop_get_next_timeout(&tv);
-                if (((timeout >= 0) && (timeout < next_time)) ||
+		next_time = uloop_get_next_timeout(ctx, &ts);
+                if (((timeout >= 0) && (timeout * NSEC_PER_MSEC < next_time)) ||
                     ((next_time == -1) && (timeout != -1))
 		   ) {
-                        next_time = timeout;
+                        next_time = timeout * NSEC_PER_MSEC;
 		}
-		uloop_run_events(next_time);
+		uloop_run_events(ctx, next_time);
 	}
 
-	--uloop_run_depth;
+	--ctx->run_depth;
+	cur_ctx = prev_ctx;
 
-	return uloop_status;
+	return ctx->status;
 }
 
-void uloop_done(void)
+int uloop_run_timeout(int timeout)
 {
-	uloop_setup_signals(false);
+	return uloop_ctx_run_timeout(uloop_ctx_current(), timeout);
+}
 
-	if (poll_fd >= 0) {
-		close(poll_fd);
-		poll_fd = -1;
-	}
+static void uloop_ctx_done(struct uloop_ctx *ctx)
+{
+	waker_done(ctx);
+	uloop_close_pollfd(ctx);
+
+	uloop_clear_fds(ctx);
+	uloop_clear_timeouts(ctx);
+	uloop_clear_deferred(ctx);
+	uloop_clear_posted(ctx);
+	uloop_free_events(ctx);
+	uloop_ctx_reset_cb_stats(ctx);
+}
+
+void uloop_ctx_hold(struct uloop_ctx *ctx)
+{
+	ctx->held++;
+}
+
+void uloop_ctx_release(struct uloop_ctx *ctx)
+{
+	ctx->held--;
+}
 
-	if (waker_pipe >= 0) {
-		uloop_fd_delete(&waker_fd);
-		close(waker_pipe);
-		close(waker_fd.fd);
-		waker_pipe = -1;
+int uloop_ctx_free(struct uloop_ctx *ctx)
+{
+	if (!ctx || ctx == &default_ctx)
+		return 0;
+
+	/* pool threads would still post the results to ctx */
+	if (ctx->held) {
+		errno = EBUSY;
+		return -1;
 	}
 
-	uloop_clear_timeouts();
+	if (cur_ctx == ctx)
+		cur_ctx = NULL;
+
+	uloop_ctx_done(ctx);
+	free(ctx);
+
+	return 0;
+}
+
+void uloop_done(void)
+{
+	uloop_setup_signals(false);
 	uloop_clear_processes();
+	uloop_ctx_done(&default_ctx);
 }
@@ -31,14 +31,24 @@
 #endif
 
 #include "list.h"
+#include "avl.h"
 
+struct uloop_ctx;
 struct uloop_fd;
 struct uloop_timeout;
 struct uloop_process;
+struct uloop_io;
+struct uloop_work;
+struct uloop_defer;
 
 typedef void (*uloop_fd_handler)(struct uloop_fd *u, unsigned int events);
 typedef void (*uloop_timeout_handler)(struct uloop_timeout *t);
 typedef void (*uloop_process_handler)(struct uloop_process *c, int ret);
+typedef void (*uloop_io_handler)(struct uloop_io *io, int res);
+typedef void (*uloop_post_handler)(void *arg);
+typedef void (*uloop_defer_handler)(struct uloop_defer *d);
+typedef int (*uloop_work_handler)(struct uloop_work *w);
+typedef void (*uloop_work_done_handler)(struct uloop_work *w, int ret);
 
 #define ULOOP_READ		(1 << 0)
 #define ULOOP_WRITE		(1 << 1)
@@ -64,6 +74,8 @@ struct uloop_fd
 	bool error;
 	bool registered;
 	uint8_t flags;
+
+	struct uloop_ctx *ctx;
 };
 
 struct uloop_timeout
@@ -72,39 +84,334 @@ struct uloop_timeout
 	bool pending;
 
 	uloop_timeout_handler cb;
+
+	/* the expiry, time is kept in sync for existing users */
 	struct timeval time;
+	struct timespec deadline;
+
+	/*
+	 * slack: how many ms the timeout may fire late. Timeouts with
+	 * slack are rounded up to shared expiry points, so that several of
+	 * them can be handled in a single wakeup.
+	 */
+	unsigned int slack;
+
+	struct uloop_ctx *ctx;
 };
 
-struct uloop_process
+/*
+ * uloop_defer: a callback to run once on the next loop iteration, before
+ * waiting for events. Cheaper than a timeout with a delay of 0.
+ */
+struct uloop_defer
 {
 	struct list_head list;
 	bool pending;
 
+	uloop_defer_handler cb;
+	struct uloop_ctx *ctx;
+};
+
+struct uloop_process
+{
+	struct avl_node avl;
+	bool pending;
+
 	uloop_process_handler cb;
 	pid_t pid;
+
+	/* used internally to watch the process through a pidfd if supported */
+	struct uloop_fd pidfd;
+};
+
+/*
+ * uloop_io: a single read or write submitted to the kernel and completed
+ * asynchronously, only available with the io_uring backend (USE_IO_URING).
+ * The callback receives the number of bytes transferred or -errno and is
+ * called from the loop of the context that was current on submission.
+ * A cancelled request still calls the callback, usually with -ECANCELED,
+ * so the uloop_io and the buffer must stay valid until then.
+ */
+struct uloop_io
+{
+	struct uloop_fd fd;
+	uloop_io_handler cb;
+	bool pending;
+	int res;
+};
+
+struct uloop_stats
+{
+	/* number of times the loop returned from waiting for events */
+	uint64_t wakeups;
+
+	uint64_t timeouts;
+	/* timeouts with slack that fired along with an earlier timeout */
+	uint64_t timeouts_coalesced;
+
+	/* calls run from uloop_post() */
+	uint64_t posts;
+
+	/*
+	 * syscalls made to register fds with the poll backend (epoll_ctl,
+	 * kevent, fcntl), and calls avoided for unchanged or batched updates
+	 */
+	uint64_t fd_syscalls;
+	uint64_t fd_syscalls_saved;
+
+	/* busy polling found events before blocking (hit) or gave up (miss) */
+	uint64_t busy_poll_hits;
+	uint64_t busy_poll_misses;
+};
+
+enum {
+	ULOOP_CB_FD,
+	ULOOP_CB_TIMEOUT,
+};
+
+#define ULOOP_CB_STATS_BUCKETS	40
+
+/*
+ * uloop_cb_stats: run time of one callback function, collected while
+ * uloop_instrument is set. hist[n] counts calls that took less than
+ * 2^n ns (and at least 2^(n-1) ns), the last bucket counts the rest.
+ */
+struct uloop_cb_stats
+{
+	const void *cb;
+	int type;
+
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint32_t hist[ULOOP_CB_STATS_BUCKETS];
+};
+
+typedef void (*uloop_cb_stats_handler)(const struct uloop_cb_stats *s, void *priv);
+
+/*
+ * uloop_post_entry: caller provided storage for uloop_post_entry_add(),
+ * which posts without allocating and therefore cannot fail. The entry
+ * must stay valid until fn has been called.
+ */
+struct uloop_post_entry
+{
+	struct uloop_post_entry *next;
+	uloop_post_handler fn;
+	void *arg;
+
+	/* used internally */
+	bool alloc;
+};
+
+/*
+ * uloop_work: blocking work for a thread pool. cb runs on a pool thread
+ * and must not touch the loop, its return value is passed to done,
+ * which runs on the thread of the loop that was current in
+ * uloop_work_add(). Embed it in a struct to pass data.
+ */
+struct uloop_work
+{
+	struct list_head list;
+	bool pending;
+
+	uloop_work_handler cb;
+	uloop_work_done_handler done;
+
+	/* used internally */
+	struct uloop_ctx *ctx;
+	struct uloop_post_entry post;
+	uint64_t queued;
+	int ret;
+};
+
+struct uloop_work_stats
+{
+	/* current queue depth, running work items and pool threads */
+	unsigned int queued;
+	unsigned int running;
+	unsigned int threads;
+
+	uint64_t completed;
+
+	/* time spent waiting in the queue and running, in ns */
+	uint64_t wait_time;
+	uint64_t max_wait_time;
+	uint64_t run_time;
+	uint64_t max_run_time;
 };
 
 extern bool uloop_cancelled;
 extern bool uloop_handle_sigchld;
 
+/*
+ * uloop_batch_events: dispatch every event returned by one poll call
+ * before checking timeouts again, instead of one event per iteration
+ */
+extern bool uloop_batch_events;
+
+/*
+ * uloop_use_signalfd: (Linux only) receive SIGINT, SIGTERM and SIGCHLD
+ * through a signalfd instead of signal handlers. The signals are blocked
+ * while the loop is initialized; child processes inherit the signal mask,
+ * so it needs to be restored after fork() before running other programs.
+ */
+extern bool uloop_use_signalfd;
+
+/*
+ * uloop_use_timerfd: (Linux epoll backend only) wait for timeouts with
+ * a timerfd instead of the millisecond timeout of epoll_wait, so that
+ * timers set with uloop_timeout_set_us/_ns expire on time. Costs one
+ * extra syscall per loop iteration while timeouts are pending.
+ */
+extern bool uloop_use_timerfd;
+
+/*
+ * uloop_batch_fd_updates: (Linux epoll backend only) queue changes to
+ * the flags of registered fds and apply them right before waiting for
+ * events, so that repeated changes within one iteration cost at most
+ * one epoll_ctl call
+ */
+extern bool uloop_batch_fd_updates;
+
+/*
+ * uloop_instrument: time every fd and timeout callback and keep
+ * per callback statistics, see uloop_foreach_cb_stats()
+ */
+extern bool uloop_instrument;
+
+/*
+ * uloop_stall_threshold: report fd and timeout callbacks that run for
+ * longer than this many microseconds through ulog (0: disabled)
+ */
+extern unsigned int uloop_stall_threshold;
+
+/* adding an fd again with the flags it is registered with does nothing */
 int uloop_fd_add(struct uloop_fd *sock, unsigned int flags);
 int uloop_fd_delete(struct uloop_fd *sock);
 
 int uloop_timeout_add(struct uloop_timeout *timeout);
 int uloop_timeout_set(struct uloop_timeout *timeout, int msecs);
+int uloop_timeout_set_us(struct uloop_timeout *timeout, int64_t usecs);
+int uloop_timeout_set_ns(struct uloop_timeout *timeout, int64_t nsecs);
 int uloop_timeout_cancel(struct uloop_timeout *timeout);
 int uloop_timeout_remaining(struct uloop_timeout *timeout);
+int64_t uloop_timeout_remaining_ns(struct uloop_timeout *timeout);
+
+int uloop_defer_add(struct uloop_defer *d);
+int uloop_defer_cancel(struct uloop_defer *d);
 
 int uloop_process_add(struct uloop_process *p);
 int uloop_process_delete(struct uloop_process *p);
 
+/*
+ * uloop_work_cancel only succeeds for work that has not started yet,
+ * otherwise the done callback will still be called
+ */
+int uloop_work_add(struct uloop_work *w);
+int uloop_work_cancel(struct uloop_work *w);
+
+/* maximum number of pool threads (default: 4) */
+int uloop_work_set_threads(int n);
+void uloop_work_get_stats(struct uloop_work_stats *stats);
+
+int uloop_io_read(struct uloop_io *io, int fd, void *buf, size_t len);
+int uloop_io_write(struct uloop_io *io, int fd, const void *buf, size_t len);
+
+/*
+ * uloop_io_cancel: returns 0 if the request is in flight and a cancel was
+ * submitted, the callback is still called. Returns 1 if the request had
+ * already completed and its callback was not dispatched yet, it will not
+ * be called and io can be freed. Returns -1 (errno ENOENT) if nothing is
+ * pending.
+ */
+int uloop_io_cancel(struct uloop_io *io);
+
 bool uloop_cancelling(void);
 
+/*
+ * uloop_ctx: an independent event loop instance with its own fds and
+ * timeouts, e.g. to run one loop per thread. The functions without a
+ * ctx argument operate on the current context of the calling thread,
+ * which is the default context unless changed by uloop_ctx_set_current()
+ * or while running uloop_ctx_run_timeout(). Registered fds and timeouts
+ * remember their context, so they can only be used from its thread.
+ *
+ * Signals and child processes are only handled by the default context,
+ * which is set up by uloop_init().
+ */
+struct uloop_ctx *uloop_ctx_new(void);
+
+/*
+ * uloop_ctx_free fails with EBUSY while uloop_work submitted from the
+ * context is outstanding, run the loop until the done callbacks came in.
+ */
+int uloop_ctx_free(struct uloop_ctx *ctx);
+
+/* used by uloop_work to keep a context with outstanding work alive */
+void uloop_ctx_hold(struct uloop_ctx *ctx);
+void uloop_ctx_release(struct uloop_ctx *ctx);
+
+struct uloop_ctx *uloop_ctx_current(void);
+void uloop_ctx_set_current(struct uloop_ctx *ctx);
+
+int uloop_ctx_set_max_events(struct uloop_ctx *ctx, int n);
+
+int uloop_ctx_fd_add(struct uloop_ctx *ctx, struct uloop_fd *sock, unsigned int flags);
+
+int uloop_ctx_timeout_add(struct uloop_ctx *ctx, struct uloop_timeout *timeout);
+int uloop_ctx_timeout_set(struct uloop_ctx *ctx, struct uloop_timeout *timeout, int msecs);
+int uloop_ctx_timeout_set_ns(struct uloop_ctx *ctx, struct uloop_timeout *timeout, int64_t nsecs);
+
+int uloop_ctx_defer_add(struct uloop_ctx *ctx, struct uloop_defer *d);
+
+int uloop_ctx_run_timeout(struct uloop_ctx *ctx, int timeout);
+static inline int uloop_ctx_run(struct uloop_ctx *ctx)
+{
+	return uloop_ctx_run_timeout(ctx, -1);
+}
+
+bool uloop_ctx_cancelling(struct uloop_ctx *ctx);
+void uloop_ctx_end(struct uloop_ctx *ctx);
+
+/* uloop_ctx_wake: interrupt a context waiting for events (thread safe) */
+void uloop_ctx_wake(struct uloop_ctx *ctx);
+
+/*
+ * uloop_post: run fn(arg) from the loop of ctx (thread safe). Calls are
+ * run in the order they were posted, at the start of a loop iteration.
+ * A burst of posts only wakes up the loop once.
+ */
+int uloop_post(struct uloop_ctx *ctx, uloop_post_handler fn, void *arg);
+void uloop_post_entry_add(struct uloop_ctx *ctx, struct uloop_post_entry *e);
+
+const struct uloop_stats *uloop_ctx_get_stats(struct uloop_ctx *ctx);
+const struct uloop_stats *uloop_get_stats(void);
+
+void uloop_ctx_foreach_cb_stats(struct uloop_ctx *ctx, uloop_cb_stats_handler fn, void *priv);
+void uloop_foreach_cb_stats(uloop_cb_stats_handler fn, void *priv);
+void uloop_ctx_reset_cb_stats(struct uloop_ctx *ctx);
+
 static inline void uloop_end(void)
 {
-	uloop_cancelled = true;
+	uloop_ctx_end(uloop_ctx_current());
 }
 
+/*
+ * uloop_set_busy_poll: poll without blocking for up to usecs before
+ * waiting for events, to reduce wakeup latency at the expense of CPU time.
+ * The actual time adapts to the time between recent events, loops with
+ * events further apart do not spin. 0 disables busy polling (default).
+ */
+int uloop_ctx_set_busy_poll(struct uloop_ctx *ctx, unsigned int usecs);
+int uloop_set_busy_poll(unsigned int usecs);
+
+/*
+ * uloop_set_max_events: set the number of events fetched per poll call
+ * (default: 10). Fails while fetched events are still being dispatched.
+ */
+int uloop_set_max_events(int n);
+
 int uloop_init(void);
 int uloop_run_timeout(int timeout);
 static inline int uloop_run(void)
@@ -0,0 +1,393 @@
+/*
+ * usock - asynchronous connect with happy eyeballs (RFC 8305)
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "ustream.h"
+#include "usock.h"
+#include "utils.h"
+
+#define USOCK_ATTEMPT_DELAY	250
+
+struct usock_attempt {
+	struct uloop_fd fd;
+	struct usock_async_connect *c;
+};
+
+static void usock_attempt_close(struct usock_attempt *a)
+{
+	if (a->fd.fd < 0)
+		return;
+
+	uloop_fd_delete(&a->fd);
+	close(a->fd.fd);
+	a->fd.fd = -1;
+}
+
+static void usock_async_connect_free(struct usock_async_connect *c)
+{
+	int i;
+
+	uloop_timeout_cancel(&c->attempt_timer);
+	uloop_timeout_cancel(&c->timeout);
+
+	for (i = 0; i < c->n_addrs; i++)
+		usock_attempt_close(&c->attempts[i]);
+
+	free(c->addrs);
+	free(c->attempts);
+	c->addrs = NULL;
+	c->attempts = NULL;
+	c->n_addrs = 0;
+	c->pending = false;
+}
+
+static void usock_async_connect_done(struct usock_async_connect *c, int idx, int error)
+{
+	int fd = -1;
+
+	if (idx >= 0) {
+		struct usock_attempt *a = &c->attempts[idx];
+
+		uloop_fd_delete(&a->fd);
+		fd = a->fd.fd;
+		a->fd.fd = -1;
+
+		memcpy(&c->addr, &c->addrs[idx].addr, c->addrs[idx].len);
+	}
+
+	usock_resolve_cancel(&c->resolve);
+	usock_async_connect_free(c);
+
+	if (fd >= 0)
+		ustream_fd_init(c->stream, fd);
+
+	c->cb(c, error);
+}
+
+static void usock_attempt_next(struct usock_async_connect *c);
+
+static void usock_attempt_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct usock_attempt *a = container_of(fd, struct usock_attempt, fd);
+	struct usock_async_connect *c = a->c;
+	socklen_t len = sizeof(int);
+	int error = 0;
+
+	if (getsockopt(fd->fd, SOL_SOCKET, SO_ERROR, &error, &len))
+		error = errno;
+
+	if (!error) {
+		usock_async_connect_done(c, a - c->attempts, 0);
+		return;
+	}
+
+	/* a failed attempt lets the next candidate start right away */
+	usock_attempt_close(a);
+	c->active--;
+	c->error = error;
+	usock_attempt_next(c);
+}
+
+static int usock_attempt_socket(int family, int socktype)
+{
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	return socket(family, socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#else
+	int fd;
+
+	fd = socket(family, socktype, 0);
+	if (fd < 0)
+		return fd;
+
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+#endif
+}
+
+static void usock_attempt_next(struct usock_async_connect *c)
+{
+	int socktype = ((c->type & 0xff) == USOCK_TCP) ? SOCK_STREAM : SOCK_DGRAM;
+
+	while (c->next < c->n_addrs) {
+		int idx = c->next++;
+		struct usock_attempt *a = &c->attempts[idx];
+		struct sockaddr *sa = (struct sockaddr *) &c->addrs[idx].addr;
+		int fd;
+
+		fd = usock_attempt_socket(sa->sa_family, socktype);
+		if (fd < 0) {
+			c->error = errno;
+			continue;
+		}
+
+		if (c->type & USOCK_NOCLOEXEC)
+			fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) & ~FD_CLOEXEC);
+
+		a->fd.fd = fd;
+		if (!connect(fd, sa, c->addrs[idx].len)) {
+			usock_async_connect_done(c, idx, 0);
+			return;
+		}
+
+		if (errno != EINPROGRESS) {
+			c->error = errno;
+			close(fd);
+			a->fd.fd = -1;
+			continue;
+		}
+
+		if (uloop_fd_add(&a->fd, ULOOP_WRITE) < 0) {
+			c->error = errno;
+			usock_attempt_close(a);
+			continue;
+		}
+		c->active++;
+
+		if (c->next < c->n_addrs)
+			uloop_timeout_set(&c->attempt_timer, c->attempt_delay ?
+					  c->attempt_delay : USOCK_ATTEMPT_DELAY);
+		return;
+	}
+
+	if (!c->active)
+		usock_async_connect_done(c, -1, c->error ? c->error : EHOSTUNREACH);
+}
+
+static void usock_attempt_timer_cb(struct uloop_timeout *t)
+{
+	struct usock_async_connect *c = container_of(t, struct usock_async_connect, attempt_timer);
+
+	usock_attempt_next(c);
+}
+
+static void usock_connect_timeout_cb(struct uloop_timeout *t)
+{
+	struct usock_async_connect *c = container_of(t, struct usock_async_connect, timeout);
+
+	usock_async_connect_done(c, -1, ETIMEDOUT);
+}
+
+static struct addrinfo *usock_next_addr(struct usock_async_connect *c,
+				       struct addrinfo *rp, int family)
+{
+	for (; rp; rp = rp->ai_next) {
+		if (rp->ai_family != AF_INET && rp->ai_family != AF_INET6)
+			continue;
+		if (rp->ai_addrlen > sizeof(c->addrs[0].addr))
+			continue;
+		if (family == AF_UNSPEC || rp->ai_family == family)
+			return rp;
+	}
+
+	return NULL;
+}
+
+/* alternate between address families, starting with the first one returned */
+static int usock_sort_addrs(struct usock_async_connect *c, struct addrinfo *result)
+{
+	struct addrinfo *rp, *cur[2];
+	int n = 0, fam;
+
+	for (rp = usock_next_addr(c, result, AF_UNSPEC); rp;
+	     rp = usock_next_addr(c, rp->ai_next, AF_UNSPEC))
+		n++;
+
+	if (!n)
+		return 0;
+
+	c->addrs = calloc(n, sizeof(*c->addrs));
+	c->attempts = calloc(n, sizeof(*c->attempts));
+	if (!c->addrs || !c->attempts)
+		return -1;
+
+	cur[0] = usock_next_addr(c, result, AF_UNSPEC);
+	cur[1] = usock_next_addr(c, result,
+				 cur[0]->ai_family == AF_INET ? AF_INET6 : AF_INET);
+	fam = 0;
+	while (cur[0] || cur[1]) {
+		rp = cur[fam];
+		if (!rp) {
+			fam = !fam;
+			continue;
+		}
+
+		memcpy(&c->addrs[c->n_addrs].addr, rp->ai_addr, rp->ai_addrlen);
+		c->addrs[c->n_addrs].len = rp->ai_addrlen;
+		c->attempts[c->n_addrs].c = c;
+		c->attempts[c->n_addrs].fd.fd = -1;
+		c->attempts[c->n_addrs].fd.cb = usock_attempt_cb;
+		c->n_addrs++;
+
+		cur[fam] = usock_next_addr(c, rp->ai_next, rp->ai_family);
+		fam = !fam;
+	}
+
+	return n;
+}
+
+static void usock_async_connect_init(struct usock_async_connect *c, int type)
+{
+	memset(&c->attempt_timer, 0, sizeof(c->attempt_timer));
+	memset(&c->timeout, 0, sizeof(c->timeout));
+	c->attempt_timer.cb = usock_attempt_timer_cb;
+	c->timeout.cb = usock_connect_timeout_cb;
+	c->type = type;
+	c->next = 0;
+	c->active = 0;
+	c->error = 0;
+	c->pending = true;
+
+	if (c->timeout_msecs > 0)
+		uloop_timeout_set(&c->timeout, c->timeout_msecs);
+}
+
+static int usock_async_connect_start(struct usock_async_connect *c,
+				     struct addrinfo *result)
+{
+	int ret;
+
+	ret = usock_sort_addrs(c, result);
+	if (ret <= 0) {
+		usock_async_connect_free(c);
+		if (!ret)
+			errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	usock_attempt_next(c);
+
+	return 0;
+}
+
+static bool usock_async_connect_valid(struct usock_async_connect *c, int type)
+{
+	if (c->pending || !c->cb || !c->stream || (type & (USOCK_SERVER | USOCK_UNIX))) {
+		errno = EINVAL;
+		return false;
+	}
+
+	return true;
+}
+
+int usock_async_connect_addrinfo(struct usock_async_connect *c, int type,
+				 struct addrinfo *result)
+{
+	if (!usock_async_connect_valid(c, type))
+		return -1;
+
+	usock_async_connect_init(c, type);
+
+	return usock_async_connect_start(c, result);
+}
+
+/* map a getaddrinfo() error to the errno passed to cb */
+static int usock_eai_errno(int error)
+{
+	switch (error) {
+	case EAI_NONAME:
+#ifdef EAI_NODATA
+	case EAI_NODATA:
+#endif
+	case EAI_SERVICE:
+		return ENOENT;
+	case EAI_AGAIN:
+		return EAGAIN;
+	case EAI_MEMORY:
+		return ENOMEM;
+	case EAI_FAMILY:
+		return EAFNOSUPPORT;
+	case EAI_SOCKTYPE:
+	case EAI_BADFLAGS:
+		return EINVAL;
+	case EAI_SYSTEM:
+		return EIO;
+	default:
+		return EHOSTUNREACH;
+	}
+}
+
+static void usock_async_connect_resolve_cb(struct usock_resolve *r,
+					   struct addrinfo *result, int error)
+{
+	struct usock_async_connect *c = container_of(r, struct usock_async_connect, resolve);
+
+	if (error) {
+		usock_async_connect_done(c, -1, usock_eai_errno(error));
+		return;
+	}
+
+	if (usock_async_connect_start(c, result))
+		c->cb(c, errno);
+}
+
+int usock_async_connect(struct usock_async_connect *c, int type,
+			const char *host, const char *service)
+{
+	int socktype = ((type & 0xff) == USOCK_TCP) ? SOCK_STREAM : SOCK_DGRAM;
+	struct addrinfo *result;
+	struct addrinfo hints = {
+		.ai_family = (type & USOCK_IPV6ONLY) ? AF_INET6 :
+			(type & USOCK_IPV4ONLY) ? AF_INET : AF_UNSPEC,
+		.ai_socktype = socktype,
+		.ai_flags = AI_ADDRCONFIG | AI_NUMERICHOST,
+	};
+	int ret;
+
+	if (!usock_async_connect_valid(c, type))
+		return -1;
+
+	if (type & USOCK_NUMERIC) {
+		ret = getaddrinfo(host, service, &hints, &result);
+		if (ret) {
+			errno = usock_eai_errno(ret);
+			return -1;
+		}
+
+		ret = usock_async_connect_addrinfo(c, type, result);
+		freeaddrinfo(result);
+
+		return ret;
+	}
+
+	usock_async_connect_init(c, type);
+
+	c->resolve.cb = usock_async_connect_resolve_cb;
+	if (usock_resolve(&c->resolve, type, host, service)) {
+		usock_async_connect_free(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+int usock_async_connect_cancel(struct usock_async_connect *c)
+{
+	if (!c->pending)
+		return 0;
+
+	usock_resolve_cancel(&c->resolve);
+	usock_async_connect_free(c);
+
+	return 0;
+}
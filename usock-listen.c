@@ -0,0 +1,216 @@
+/*
+ * usock - sharded SO_REUSEPORT listeners
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+#include "usock.h"
+#include "utils.h"
+
+#define USOCK_ACCEPT_BATCH	16
+#define USOCK_ACCEPT_BACKOFF	100
+
+static int usock_accept(int fd)
+{
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int sfd;
+
+	sfd = accept(fd, NULL, NULL);
+	if (sfd < 0)
+		return sfd;
+
+	fcntl(sfd, F_SETFD, fcntl(sfd, F_GETFD) | FD_CLOEXEC);
+	fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+	return sfd;
+#endif
+}
+
+static void usock_listener_resume(struct uloop_timeout *t)
+{
+	struct usock_listener_shard *s = container_of(t, struct usock_listener_shard, backoff);
+
+	uloop_ctx_fd_add(s->ctx, &s->fd, ULOOP_READ);
+}
+
+/*
+ * Out of fds, the pending connections stay in the backlog and keep the
+ * listener readable. Stop polling it for a while instead of spinning.
+ */
+static void usock_listener_backoff(struct usock_listener_shard *s)
+{
+	s->ctx = s->fd.ctx;
+	uloop_fd_delete(&s->fd);
+
+	s->backoff.cb = usock_listener_resume;
+	uloop_ctx_timeout_set(s->ctx, &s->backoff, USOCK_ACCEPT_BACKOFF);
+}
+
+static void usock_listener_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct usock_listener_shard *s = container_of(fd, struct usock_listener_shard, fd);
+	struct usock_listener *l = s->l;
+	unsigned int batch = l->accept_batch ? l->accept_batch : USOCK_ACCEPT_BATCH;
+	unsigned int i;
+	int sfd;
+
+	/*
+	 * Accept a bounded number of connections per wakeup, so that a busy
+	 * listener does not starve the other fds of this loop.
+	 */
+	for (i = 0; i < batch; i++) {
+		sfd = usock_accept(fd->fd);
+		if (sfd < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			s->errors++;
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ENOBUFS || errno == ENOMEM)
+				usock_listener_backoff(s);
+			break;
+		}
+
+		s->accepted++;
+		l->cb(l, s - l->shards, sfd);
+	}
+}
+
+static int usock_listener_steer_cpu(int fd)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+	/* return the cpu the packet was received on as the socket index */
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len = ARRAY_SIZE(code),
+		.filter = code,
+	};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+static const char *usock_bound_port(int fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(fd, (struct sockaddr *) &ss, &len))
+		return NULL;
+
+	switch (ss.ss_family) {
+	case AF_INET:
+		return usock_port(ntohs(((struct sockaddr_in *) &ss)->sin_port));
+	case AF_INET6:
+		return usock_port(ntohs(((struct sockaddr_in6 *) &ss)->sin6_port));
+	default:
+		return NULL;
+	}
+}
+
+int usock_listener_open(struct usock_listener *l, int type, const char *host,
+			const char *service, int n_shards, bool steer_cpu)
+{
+	const char *port = service;
+	int i;
+
+	if (!l->cb || n_shards <= 0 || (type & USOCK_UNIX)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	l->shards = calloc(n_shards, sizeof(*l->shards));
+	if (!l->shards)
+		return -1;
+
+	type |= USOCK_SERVER | USOCK_NONBLOCK | USOCK_REUSEPORT;
+	type &= ~USOCK_NOCLOEXEC;
+
+	for (i = 0; i < n_shards; i++) {
+		struct usock_listener_shard *s = &l->shards[i];
+
+		s->l = l;
+		s->fd.cb = usock_listener_cb;
+		s->fd.fd = usock(type, host, port);
+		if (s->fd.fd < 0)
+			goto error;
+
+		/* bind the remaining shards to the port picked for the first one */
+		if (!i && !(port = usock_bound_port(s->fd.fd))) {
+			i++;
+			goto error;
+		}
+	}
+	l->n_shards = n_shards;
+
+	/* the program applies to the whole reuseport group */
+	if (steer_cpu && usock_listener_steer_cpu(l->shards[0].fd.fd)) {
+		usock_listener_close(l);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	while (--i >= 0)
+		close(l->shards[i].fd.fd);
+	free(l->shards);
+	l->shards = NULL;
+	return -1;
+}
+
+int usock_listener_add(struct usock_listener *l, int shard, struct uloop_ctx *ctx)
+{
+	if (shard < 0 || shard >= l->n_shards)
+		return -1;
+
+	return uloop_ctx_fd_add(ctx, &l->shards[shard].fd, ULOOP_READ);
+}
+
+void usock_listener_close(struct usock_listener *l)
+{
+	int i;
+
+	for (i = 0; i < l->n_shards; i++) {
+		uloop_timeout_cancel(&l->shards[i].backoff);
+		uloop_fd_delete(&l->shards[i].fd);
+		close(l->shards[i].fd.fd);
+	}
+
+	free(l->shards);
+	l->shards = NULL;
+	l->n_shards = 0;
+}
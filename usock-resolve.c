@@ -0,0 +1,336 @@
+/*
+ * usock - asynchronous name resolution with a small cache
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Lookups run on the uloop_work thread pool and complete on the loop
+ * that started them. Results (including failures) are kept in a cache
+ * shared by all loops, so the cache is protected by a mutex.
+ *
+ * A running lookup lives in its own job, so that cancelling it only
+ * detaches the request: the job still fills the cache, but never touches
+ * the (possibly freed) request again.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#include "usock.h"
+#include "avl.h"
+#include "avl-cmp.h"
+#include "utils.h"
+
+#define USOCK_RESOLVE_KEY_FLAGS \
+	(0xff | USOCK_SERVER | USOCK_NUMERIC | USOCK_IPV6ONLY | USOCK_IPV4ONLY)
+
+struct usock_resolve_job {
+	struct uloop_work work;
+	struct usock_resolve *r;
+	unsigned int gen;
+
+	struct addrinfo *result;
+	unsigned int ttl;
+	int key_len;
+	char key[];
+};
+
+struct usock_resolve_entry {
+	struct avl_node node;
+	int refcount;
+
+	time_t expires;
+	struct addrinfo *result;
+	int error;
+};
+
+static int usock_resolver_default(const char *host, const char *service,
+				  const struct addrinfo *hints,
+				  struct addrinfo **result, unsigned int *ttl)
+{
+	return getaddrinfo(host, service, hints, result);
+}
+
+usock_resolver_handler usock_resolver = usock_resolver_default;
+void (*usock_resolver_free)(struct addrinfo *result) = freeaddrinfo;
+unsigned int usock_resolve_ttl = 60;
+unsigned int usock_resolve_negative_ttl = 5;
+unsigned int usock_resolve_cache_size = 256;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static AVL_TREE(cache, avl_strcmp, false, NULL);
+static struct usock_resolve_stats cache_stats;
+
+static time_t usock_resolve_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* called with cache_lock held */
+static void usock_resolve_entry_put(struct usock_resolve_entry *e)
+{
+	if (--e->refcount)
+		return;
+
+	if (e->result)
+		usock_resolver_free(e->result);
+	free(e);
+}
+
+/* called with cache_lock held */
+static void usock_resolve_entry_remove(struct usock_resolve_entry *e)
+{
+	avl_delete(&cache, &e->node);
+	usock_resolve_entry_put(e);
+}
+
+/* called with cache_lock held */
+static void usock_resolve_expire(time_t now)
+{
+	struct usock_resolve_entry *e, *tmp;
+
+	avl_for_each_element_safe(&cache, e, node, tmp) {
+		if (e->expires <= now)
+			usock_resolve_entry_remove(e);
+	}
+}
+
+static void usock_resolve_complete(struct usock_resolve *r)
+{
+	struct usock_resolve_entry *e = r->entry;
+
+	r->entry = NULL;
+	r->pending = false;
+	r->cb(r, e->result, e->error);
+
+	pthread_mutex_lock(&cache_lock);
+	usock_resolve_entry_put(e);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void usock_resolve_defer_cb(struct uloop_defer *d)
+{
+	usock_resolve_complete(container_of(d, struct usock_resolve, defer));
+}
+
+static int usock_resolve_work_cb(struct uloop_work *w)
+{
+	struct usock_resolve_job *job = container_of(w, struct usock_resolve_job, work);
+	char key[sizeof(((struct usock_resolve *) 0)->key)];
+	char *service, *host;
+	int type = atoi(job->key);
+	int socktype = ((type & 0xff) == USOCK_TCP) ? SOCK_STREAM : SOCK_DGRAM;
+	struct addrinfo hints = {
+		.ai_family = (type & USOCK_IPV6ONLY) ? AF_INET6 :
+			(type & USOCK_IPV4ONLY) ? AF_INET : AF_UNSPEC,
+		.ai_socktype = socktype,
+		.ai_flags = AI_ADDRCONFIG
+			| ((type & USOCK_SERVER) ? AI_PASSIVE : 0)
+			| ((type & USOCK_NUMERIC) ? AI_NUMERICHOST : 0),
+	};
+
+	/* the key is "<type>/<service>/<host>" */
+	strcpy(key, job->key);
+	service = strchr(key, '/') + 1;
+	host = strchr(service, '/');
+	*(host++) = 0;
+
+	return usock_resolver(*host ? host : NULL, *service ? service : NULL,
+			      &hints, &job->result, &job->ttl);
+}
+
+static void usock_resolve_work_done(struct uloop_work *w, int ret)
+{
+	struct usock_resolve_job *job = container_of(w, struct usock_resolve_job, work);
+	struct usock_resolve *r = job->r;
+	struct usock_resolve_entry *e, *old;
+	time_t now = usock_resolve_now();
+	unsigned int ttl = job->ttl;
+	char *key;
+
+	/* only deliver to the lookup that started this job */
+	if (r && (r->job != job || r->gen != job->gen))
+		r = NULL;
+
+	if (r)
+		r->job = NULL;
+
+	e = calloc_a(sizeof(*e), &key, job->key_len);
+	if (!e) {
+		if (job->result)
+			usock_resolver_free(job->result);
+		free(job);
+
+		if (r) {
+			r->pending = false;
+			r->cb(r, NULL, EAI_MEMORY);
+		}
+		return;
+	}
+
+	memcpy(key, job->key, job->key_len);
+	e->node.key = key;
+	e->result = job->result;
+	e->error = ret;
+	e->refcount = 1;
+	free(job);
+
+	if (!ttl)
+		ttl = ret ? usock_resolve_negative_ttl : usock_resolve_ttl;
+	e->expires = now + ttl;
+
+	pthread_mutex_lock(&cache_lock);
+	old = avl_find_element(&cache, key, old, node);
+	if (old)
+		usock_resolve_entry_remove(old);
+
+	if (cache.count >= usock_resolve_cache_size)
+		usock_resolve_expire(now);
+
+	if (ttl && cache.count < usock_resolve_cache_size) {
+		avl_insert(&cache, &e->node);
+		e->refcount++;
+	}
+
+	/* cancelled while running, the result only goes to the cache */
+	if (!r) {
+		usock_resolve_entry_put(e);
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	r->entry = e;
+	usock_resolve_complete(r);
+}
+
+int usock_resolve(struct usock_resolve *r, int type, const char *host,
+		  const char *service)
+{
+	struct usock_resolve_job *job;
+	struct usock_resolve_entry *e;
+	int len;
+
+	if (r->pending || !r->cb)
+		return -1;
+
+	if (service && strchr(service, '/')) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = snprintf(r->key, sizeof(r->key), "%d/%s/%s",
+		       type & USOCK_RESOLVE_KEY_FLAGS,
+		       service ? service : "", host ? host : "");
+	if (len < 0 || len >= (int) sizeof(r->key)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	r->key_len = len + 1;
+
+	pthread_mutex_lock(&cache_lock);
+	e = avl_find_element(&cache, r->key, e, node);
+	if (e && e->expires <= usock_resolve_now()) {
+		usock_resolve_entry_remove(e);
+		e = NULL;
+	}
+
+	if (e) {
+		e->refcount++;
+		cache_stats.hits++;
+	} else {
+		cache_stats.misses++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	r->gen++;
+	if (e) {
+		r->pending = true;
+		r->entry = e;
+		r->defer.cb = usock_resolve_defer_cb;
+		uloop_defer_add(&r->defer);
+		return 0;
+	}
+
+	job = calloc(1, sizeof(*job) + r->key_len);
+	if (!job)
+		return -1;
+
+	job->r = r;
+	job->gen = r->gen;
+	job->key_len = r->key_len;
+	memcpy(job->key, r->key, r->key_len);
+	job->work.cb = usock_resolve_work_cb;
+	job->work.done = usock_resolve_work_done;
+	if (uloop_work_add(&job->work)) {
+		free(job);
+		return -1;
+	}
+
+	r->job = job;
+	r->pending = true;
+
+	return 0;
+}
+
+int usock_resolve_cancel(struct usock_resolve *r)
+{
+	if (!r->pending)
+		return 0;
+
+	if (r->entry) {
+		uloop_defer_cancel(&r->defer);
+		pthread_mutex_lock(&cache_lock);
+		usock_resolve_entry_put(r->entry);
+		pthread_mutex_unlock(&cache_lock);
+		r->entry = NULL;
+	} else if (r->job) {
+		/* a running job completes on its own, without calling cb */
+		if (uloop_work_cancel(&r->job->work))
+			r->job->r = NULL;
+		else
+			free(r->job);
+		r->job = NULL;
+	}
+
+	r->pending = false;
+	return 0;
+}
+
+void usock_resolve_flush(void)
+{
+	struct usock_resolve_entry *e, *tmp;
+
+	pthread_mutex_lock(&cache_lock);
+	avl_for_each_element_safe(&cache, e, node, tmp)
+		usock_resolve_entry_remove(e);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void usock_resolve_get_stats(struct usock_resolve_stats *stats)
+{
+	pthread_mutex_lock(&cache_lock);
+	*stats = cache_stats;
+	stats->entries = cache.count;
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -55,6 +55,10 @@ static int usock_connect(int type, struct sockaddr *sa, int sa_len, int family,
 	if (server) {
 		const int one = 1;
 		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+		if (type & USOCK_REUSEPORT)
+			setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif
 
 		if (!bind(sock, sa, sa_len) &&
 		    (socktype != SOCK_STREAM || !listen(sock, SOMAXCONN)))
@@ -19,6 +19,15 @@
 #ifndef USOCK_H_
 #define USOCK_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+#include "uloop.h"
+
+struct ustream_fd;
+
 #define USOCK_TCP 0
 #define USOCK_UDP 1
 
@@ -29,6 +38,7 @@
 #define USOCK_IPV6ONLY		0x2000
 #define USOCK_IPV4ONLY		0x4000
 #define USOCK_UNIX		0x8000
+#define USOCK_REUSEPORT		0x10000
 
 const char *usock_port(int port);
 int usock(int type, const char *host, const char *service);
@@ -51,4 +61,194 @@ usock_inet(int type, const char *host, const char *service, void *addr)
  */
 int usock_wait_ready(int fd, int msecs);
 
+/*
+ * usock_listener: a TCP listener sharded over several SO_REUSEPORT sockets
+ * bound to the same address, so that each shard can be served by its own
+ * loop (e.g. one uloop_ctx per core) and the kernel spreads incoming
+ * connections between them.
+ *
+ * Connections are accepted in batches of up to accept_batch (default 16)
+ * per wakeup and handed to cb already non-blocking and close-on-exec.
+ * If accept fails for lack of fds or memory, the shard stops polling for
+ * 100 msecs, so that the pending backlog does not keep the loop busy.
+ */
+struct usock_listener;
+
+typedef void (*usock_listener_handler)(struct usock_listener *l, int shard, int fd);
+
+struct usock_listener_shard {
+	struct uloop_fd fd;
+	struct usock_listener *l;
+
+	/* polling is paused for a while when accept runs out of fds */
+	struct uloop_timeout backoff;
+	struct uloop_ctx *ctx;
+
+	uint64_t accepted;
+	uint64_t errors;
+};
+
+struct usock_listener {
+	usock_listener_handler cb;
+	unsigned int accept_batch;
+
+	int n_shards;
+	struct usock_listener_shard *shards;
+};
+
+/**
+ * Create the listening sockets of a sharded listener.
+ *
+ * If service is "0", all shards share the port picked for the first one.
+ * With steer_cpu, a BPF program hands each connection to the shard whose
+ * index matches the cpu that received it, falling back to the kernel's
+ * hash if there is no such shard. This only pays off if the loop serving
+ * shard n is pinned to cpu n (Linux only).
+ *
+ * @param l listener with cb (and optionally accept_batch) set
+ * @param type USOCK_TCP plus address flags, USOCK_SERVER is implied
+ * @param n_shards number of sockets to create
+ */
+int usock_listener_open(struct usock_listener *l, int type, const char *host,
+			const char *service, int n_shards, bool steer_cpu);
+
+/**
+ * Register one shard with a loop. Must be called before that loop runs
+ * or from its thread.
+ */
+int usock_listener_add(struct usock_listener *l, int shard, struct uloop_ctx *ctx);
+
+void usock_listener_close(struct usock_listener *l);
+
+/*
+ * usock_resolve: asynchronous getaddrinfo(). The lookup runs on the
+ * uloop_work thread pool and cb is called from the loop that started it.
+ * The result belongs to the cache and is only valid during cb; error is
+ * the getaddrinfo() return code.
+ *
+ * Results are cached for the ttl reported by the resolver, or for
+ * usock_resolve_ttl secs (usock_resolve_negative_ttl for failures) if it
+ * reports none, so repeated lookups complete on the next loop iteration
+ * without a thread handoff.
+ */
+struct usock_resolve;
+struct usock_resolve_job;
+struct usock_resolve_entry;
+struct addrinfo;
+
+typedef void (*usock_resolve_handler)(struct usock_resolve *r,
+				      struct addrinfo *result, int error);
+
+/* stores the result in *result and an optional ttl in secs in *ttl */
+typedef int (*usock_resolver_handler)(const char *host, const char *service,
+				      const struct addrinfo *hints,
+				      struct addrinfo **result, unsigned int *ttl);
+
+struct usock_resolve {
+	usock_resolve_handler cb;
+
+	bool pending;
+	unsigned int gen;
+	struct usock_resolve_job *job;
+	struct uloop_defer defer;
+	struct usock_resolve_entry *entry;
+	int key_len;
+	char key[320];
+};
+
+struct usock_resolve_stats {
+	uint64_t hits;
+	uint64_t misses;
+	unsigned int entries;
+};
+
+/* resolver used for lookups (getaddrinfo by default) and its free function */
+extern usock_resolver_handler usock_resolver;
+extern void (*usock_resolver_free)(struct addrinfo *result);
+
+extern unsigned int usock_resolve_ttl;
+extern unsigned int usock_resolve_negative_ttl;
+extern unsigned int usock_resolve_cache_size;
+
+/**
+ * Start resolving host/service with the hints usock() would use for type.
+ *
+ * @return 0 if the lookup was started, -1 on error
+ */
+int usock_resolve(struct usock_resolve *r, int type, const char *host,
+		  const char *service);
+
+/**
+ * Stop a pending lookup, cb is not called afterwards. If the resolver is
+ * already running, its result still ends up in the cache.
+ */
+int usock_resolve_cancel(struct usock_resolve *r);
+
+/* drop all cached results */
+void usock_resolve_flush(void);
+
+void usock_resolve_get_stats(struct usock_resolve_stats *stats);
+
+/*
+ * usock_async_connect: non-blocking connect that does not stall the loop.
+ *
+ * The candidate addresses are tried in order, alternating between IPv6
+ * and IPv4, with a new attempt started every attempt_delay msecs (default
+ * 250) while the earlier ones are still pending, or immediately once an
+ * attempt fails (RFC 8305). The first attempt to complete wins, the
+ * others are closed.
+ *
+ * On success, stream is set up with ustream_fd_init() before cb is called
+ * with error 0. Otherwise cb gets the errno of the last failure, or
+ * ETIMEDOUT once timeout_msecs (if set) have passed. Lookup failures are
+ * mapped to errno values, e.g. ENOENT for an unknown name or service,
+ * EAGAIN for a temporary failure and ENOMEM. cb may be called
+ * before usock_async_connect() returns.
+ */
+struct usock_async_connect;
+struct usock_attempt;
+
+typedef void (*usock_async_connect_handler)(struct usock_async_connect *c, int error);
+
+struct usock_async_connect {
+	usock_async_connect_handler cb;
+	struct ustream_fd *stream;
+	int attempt_delay;
+	int timeout_msecs;
+
+	/* address of the connected peer */
+	struct sockaddr_storage addr;
+
+	bool pending;
+	int type;
+	int next, active, error;
+	int n_addrs;
+	struct {
+		struct sockaddr_storage addr;
+		socklen_t len;
+	} *addrs;
+	struct usock_attempt *attempts;
+	struct uloop_timeout attempt_timer;
+	struct uloop_timeout timeout;
+	struct usock_resolve resolve;
+};
+
+/**
+ * Start connecting to host/service.
+ *
+ * Host names are looked up with usock_resolve(), numeric addresses are
+ * parsed right away.
+ *
+ * @param type USOCK_TCP or USOCK_UDP plus USOCK_IPV4ONLY, USOCK_IPV6ONLY,
+ *             USOCK_NUMERIC and USOCK_NOCLOEXEC
+ * @return 0 if the attempt was started, -1 on error
+ */
+int usock_async_connect(struct usock_async_connect *c, int type,
+			const char *host, const char *service);
+int usock_async_connect_addrinfo(struct usock_async_connect *c, int type,
+				 struct addrinfo *result);
+
+/* stop a pending connect, cb is not called and c may be freed afterwards */
+int usock_async_connect_cancel(struct usock_async_connect *c);
+
 #endif /* USOCK_H_ */
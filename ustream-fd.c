@@ -16,22 +16,163 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include "ustream.h"
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#define USTREAM_SPLICE_CHUNK	65536
+
+struct ustream_fd_passing {
+	ustream_fd_notify_fds cb;
+
+	/* fds waiting to be sent, ordered by stream position */
+	struct list_head tx;
+	uint64_t tx_pos;
+};
+
+struct ustream_fd_msg {
+	struct list_head list;
+	uint64_t pos;
+	int n_fds;
+	int fds[];
+};
+
+static void ustream_fd_msg_free(struct ustream_fd_msg *m)
+{
+	int i;
+
+	list_del(&m->list);
+	for (i = 0; i < m->n_fds; i++)
+		close(m->fds[i]);
+	free(m);
+}
+
+static ssize_t ustream_fd_recvmsg(struct ustream_fd *sf, char *buf, int buflen)
+{
+	struct ustream_fd_passing *fdp = sf->fdp;
+	char cbuf[CMSG_SPACE(USTREAM_FD_MAX_FDS * sizeof(int))];
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = buflen,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int flags = 0;
+	ssize_t len;
+
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+	len = recvmsg(sf->fd.fd, &msg, flags);
+	if (len <= 0)
+		return len;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int fds[USTREAM_FD_MAX_FDS];
+		int i, n;
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+
+#ifndef MSG_CMSG_CLOEXEC
+		for (i = 0; i < n; i++)
+			fcntl(fds[i], F_SETFD, fcntl(fds[i], F_GETFD) | FD_CLOEXEC);
+#endif
+
+		if (fdp->cb) {
+			fdp->cb(sf, fds, n);
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+			close(fds[i]);
+	}
+
+	/* the kernel dropped fds that did not fit */
+	if ((msg.msg_flags & MSG_CTRUNC) && fdp->cb)
+		fdp->cb(sf, NULL, -1);
+
+	return len;
+}
+
+static ssize_t ustream_fd_sendmsg(struct ustream_fd *sf, const char *buf, int buflen)
+{
+	struct ustream_fd_passing *fdp = sf->fdp;
+	struct ustream_fd_msg *m = NULL;
+	char cbuf[CMSG_SPACE(USTREAM_FD_MAX_FDS * sizeof(int))];
+	struct iovec iov = {
+		.iov_base = (void *) buf,
+		.iov_len = buflen,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	if (!list_empty(&fdp->tx)) {
+		m = list_first_entry(&fdp->tx, struct ustream_fd_msg, list);
+
+		/* only send up to the position the next fds are attached to */
+		if (m->pos > fdp->tx_pos) {
+			if (m->pos - fdp->tx_pos < (uint64_t) buflen)
+				iov.iov_len = m->pos - fdp->tx_pos;
+			m = NULL;
+		}
+	}
+
+	if (m) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(m->n_fds * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(m->n_fds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), m->fds, m->n_fds * sizeof(int));
+	}
+
+	len = sendmsg(sf->fd.fd, &msg, MSG_NOSIGNAL);
+	if (len <= 0)
+		return len;
+
+	fdp->tx_pos += len;
+	if (m)
+		ustream_fd_msg_free(m);
+
+	return len;
+}
+
 static void ustream_fd_set_uloop(struct ustream *s, bool write)
 {
 	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
-	struct ustream_buf *buf;
 	unsigned int flags = ULOOP_EDGE_TRIGGER | ULOOP_ERROR_CB;
 
 	if (!s->read_blocked && !s->eof)
 		flags |= ULOOP_READ;
 
-	buf = s->w.head;
-	if (write || (buf && s->w.data_bytes && !s->write_error))
+	if (write || (ustream_pending_data(s, true) && !s->write_error))
 		flags |= ULOOP_WRITE;
 
 	uloop_fd_add(&sf->fd, flags);
@@ -57,7 +198,10 @@ static void ustream_fd_read_pending(struct ustream_fd *sf, bool *more)
 		if (!buf)
 			break;
 
-		len = read(sf->fd.fd, buf, buflen);
+		if (sf->fdp)
+			len = ustream_fd_recvmsg(sf, buf, buflen);
+		else
+			len = read(sf->fd.fd, buf, buflen);
 		if (len < 0) {
 			if (errno == EINTR)
 				continue;
@@ -90,7 +234,10 @@ static int ustream_fd_write(struct ustream *s, const char *buf, int buflen, bool
 		return 0;
 
 	while (buflen) {
-		len = write(sf->fd.fd, buf, buflen);
+		if (sf->fdp)
+			len = ustream_fd_sendmsg(sf, buf, buflen);
+		else
+			len = write(sf->fd.fd, buf, buflen);
 
 		if (len < 0) {
 			if (errno == EINTR)
@@ -113,6 +260,64 @@ static int ustream_fd_write(struct ustream *s, const char *buf, int buflen, bool
 	return ret;
 }
 
+static int ustream_fd_writev(struct ustream *s, const struct iovec *iov, int iovcnt)
+{
+	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	ssize_t len;
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	do {
+		len = writev(sf->fd.fd, iov, iovcnt);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN)
+			return -1;
+
+		len = 0;
+	}
+
+	if ((size_t) len < total)
+		ustream_fd_set_uloop(s, true);
+
+	return len;
+}
+
+static int ustream_fd_sendfile(struct ustream *s, int fd, off_t *off, int len)
+{
+	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	ssize_t ret;
+
+	do {
+#ifdef __linux__
+		if (off)
+			ret = sendfile(sf->fd.fd, fd, off, len);
+		else
+			ret = splice(fd, NULL, sf->fd.fd, NULL, len,
+				     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+		errno = ENOTSUP;
+		ret = -1;
+#endif
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN)
+			return -1;
+
+		ret = 0;
+	}
+
+	if (ret < len)
+		ustream_fd_set_uloop(s, true);
+
+	return ret;
+}
+
 static bool __ustream_fd_poll(struct ustream_fd *sf, unsigned int events)
 {
 	struct ustream *s = &sf->stream;
@@ -153,8 +358,76 @@ static void ustream_uloop_cb(struct uloop_fd *fd, unsigned int events)
 static void ustream_fd_free(struct ustream *s)
 {
 	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	struct ustream_fd_msg *m, *tmp;
 
 	uloop_fd_delete(&sf->fd);
+
+	if (!sf->fdp)
+		return;
+
+	list_for_each_entry_safe(m, tmp, &sf->fdp->tx, list)
+		ustream_fd_msg_free(m);
+	free(sf->fdp);
+	sf->fdp = NULL;
+}
+
+int ustream_fd_set_fd_passing(struct ustream_fd *sf, ustream_fd_notify_fds cb)
+{
+	if (!sf->fdp) {
+		sf->fdp = calloc(1, sizeof(*sf->fdp));
+		if (!sf->fdp)
+			return -1;
+
+		INIT_LIST_HEAD(&sf->fdp->tx);
+	}
+
+	sf->fdp->cb = cb;
+
+	/* fds are attached to a stream position, which the write path tracks */
+	sf->stream.writev = NULL;
+	sf->stream.sendfile = NULL;
+
+	return 0;
+}
+
+int ustream_fd_write_fds(struct ustream_fd *sf, const char *buf, int len,
+			 const int *fds, int n_fds)
+{
+	struct ustream *s = &sf->stream;
+	struct ustream_fd_msg *m;
+	int i, ret;
+
+	if (!sf->fdp || len <= 0 || n_fds <= 0 || n_fds > USTREAM_FD_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (s->write_error)
+		return -1;
+
+	m = calloc(1, sizeof(*m) + n_fds * sizeof(int));
+	if (!m)
+		return -1;
+
+	for (i = 0; i < n_fds; i++) {
+		m->fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+		if (m->fds[i] < 0) {
+			while (--i >= 0)
+				close(m->fds[i]);
+			free(m);
+			return -1;
+		}
+	}
+	m->n_fds = n_fds;
+	m->pos = sf->fdp->tx_pos + s->w.data_bytes + s->w_file_bytes;
+	list_add_tail(&m->list, &sf->fdp->tx);
+
+	/* if none of the data was accepted, there is nothing to attach to */
+	ret = ustream_write(s, buf, len, false);
+	if (ret <= 0)
+		ustream_fd_msg_free(m);
+
+	return ret;
 }
 
 void ustream_fd_init(struct ustream_fd *sf, int fd)
@@ -165,9 +438,147 @@ void ustream_fd_init(struct ustream_fd *sf, int fd)
 
 	sf->fd.fd = fd;
 	sf->fd.cb = ustream_uloop_cb;
+	sf->fdp = NULL;
 	s->set_read_blocked = ustream_fd_set_read_blocked;
 	s->write = ustream_fd_write;
+	s->writev = ustream_fd_writev;
+	s->sendfile = ustream_fd_sendfile;
 	s->free = ustream_fd_free;
 	s->poll = ustream_fd_poll;
 	ustream_fd_set_uloop(s, false);
 }
+
+#ifdef __linux__
+static void ustream_splice_done(struct ustream_splice *sp, bool error)
+{
+	uloop_fd_delete(&sp->src_fd);
+	uloop_fd_delete(&sp->pipe_fd);
+	sp->eof = true;
+	sp->error = error;
+
+	if (sp->notify_eof)
+		sp->notify_eof(sp);
+}
+
+static bool ustream_splice_pipe_full(struct ustream_splice *sp)
+{
+	int avail;
+
+	if (ioctl(sp->pipe_r, FIONREAD, &avail))
+		return false;
+
+	return avail >= sp->pipe_size;
+}
+
+static void ustream_splice_src_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct ustream_splice *sp = container_of(fd, struct ustream_splice, src_fd);
+	ssize_t len;
+
+	while (1) {
+		len = splice(fd->fd, NULL, sp->pipe_fd.fd, NULL, USTREAM_SPLICE_CHUNK,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (len > 0) {
+			sp->bytes += len;
+			if (ustream_sendfile(sp->dst, sp->pipe_r, -1, len)) {
+				ustream_splice_done(sp, true);
+				return;
+			}
+			continue;
+		}
+
+		if (!len) {
+			ustream_splice_done(sp, false);
+			return;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN)
+			break;
+
+		/* wait for the destination to drain the pipe before reading on */
+		if (ustream_splice_pipe_full(sp)) {
+			uloop_fd_delete(&sp->src_fd);
+			uloop_fd_add(&sp->pipe_fd, ULOOP_WRITE);
+		}
+		return;
+	}
+
+	ustream_splice_done(sp, true);
+}
+
+static void ustream_splice_pipe_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct ustream_splice *sp = container_of(fd, struct ustream_splice, pipe_fd);
+
+	uloop_fd_delete(&sp->pipe_fd);
+	uloop_fd_add(&sp->src_fd, ULOOP_READ);
+}
+
+int ustream_splice_init(struct ustream_splice *sp, struct ustream_fd *src,
+			struct ustream *dst)
+{
+	struct ustream *s = &src->stream;
+	int pfd[2];
+	char *data;
+	int len;
+
+	if (pipe2(pfd, O_NONBLOCK | O_CLOEXEC))
+		return -1;
+
+	sp->src_fd.fd = fcntl(src->fd.fd, F_DUPFD_CLOEXEC, 0);
+	if (sp->src_fd.fd < 0) {
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+	}
+
+	sp->src = src;
+	sp->dst = dst;
+	sp->pipe_r = pfd[0];
+	sp->pipe_fd.fd = pfd[1];
+	sp->pipe_fd.cb = ustream_splice_pipe_cb;
+	sp->src_fd.cb = ustream_splice_src_cb;
+	sp->pipe_size = fcntl(pfd[1], F_GETPIPE_SZ);
+	if (sp->pipe_size <= 0)
+		sp->pipe_size = USTREAM_SPLICE_CHUNK;
+	sp->bytes = 0;
+	sp->eof = false;
+	sp->error = false;
+
+	/* pass on what the source stream has already read */
+	while ((data = ustream_get_read_buf(s, &len)) != NULL) {
+		ustream_write(dst, data, len, false);
+		ustream_consume(s, len);
+	}
+
+	ustream_set_read_blocked(s, true);
+	uloop_fd_add(&sp->src_fd, ULOOP_READ);
+
+	return 0;
+}
+
+void ustream_splice_free(struct ustream_splice *sp)
+{
+	uloop_fd_delete(&sp->src_fd);
+	uloop_fd_delete(&sp->pipe_fd);
+	close(sp->src_fd.fd);
+	close(sp->pipe_fd.fd);
+	close(sp->pipe_r);
+
+	ustream_set_read_blocked(&sp->src->stream, false);
+}
+#else
+int ustream_splice_init(struct ustream_splice *sp, struct ustream_fd *src,
+			struct ustream *dst)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+void ustream_splice_free(struct ustream_splice *sp)
+{
+}
+#endif
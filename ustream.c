@@ -21,8 +21,42 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "ustream.h"
+#include "utils.h"
+
+#define USTREAM_COPY_BUFLEN	4096
+
+/* a range of a file queued with ustream_sendfile */
+struct ustream_file {
+	struct list_head list;
+
+	int fd;
+	off_t off;
+	size_t len;
+
+	/* identifies the source of a stream (off < 0) entry */
+	dev_t dev;
+	ino_t ino;
+
+	/* buffered bytes to write between the previous file and this one */
+	int before;
+
+	/* set when the data needs to be copied through user space */
+	char *copy;
+	int copy_ofs, copy_len;
+};
+
+#ifdef IOV_MAX
+#define USTREAM_IOV_MAX	IOV_MAX
+#else
+#define USTREAM_IOV_MAX	1024
+#endif
 
 static void ustream_init_buf(struct ustream_buf *buf, int len)
 {
@@ -49,6 +83,89 @@ static void ustream_add_buf(struct ustream_buf_list *l, struct ustream_buf *buf)
 		l->data_tail = l->head;
 }
 
+/*
+ * A ring buffer list consists of a single ustream_buf whose data lives in
+ * a mirrored mapping (cbuf_alloc), so data..tail is always contiguous.
+ * end is kept at data + capacity, which makes all the tail space checks
+ * of the regular buffer code work unchanged. buf has to stay the last
+ * member, its (unused) head is a flexible array.
+ */
+struct ustream_ring {
+	char *base;
+	unsigned int order;
+	int size, cap;
+
+	struct ustream_buf buf;
+};
+
+static bool ustream_is_ring(struct ustream_buf_list *l)
+{
+	return l->alloc == ustream_alloc_ring;
+}
+
+static void ustream_ring_reset(struct ustream_buf *buf)
+{
+	struct ustream_ring *r = container_of(buf, struct ustream_ring, buf);
+
+	buf->next = NULL;
+	buf->data = buf->tail = r->base;
+	buf->end = r->base + r->cap;
+	*buf->data = 0;
+}
+
+int ustream_alloc_ring(struct ustream *s, struct ustream_buf_list *l)
+{
+	struct ustream_ring *r;
+	unsigned int order;
+	int len = l->buffer_len;
+
+	/* the ring is the only buffer of the list */
+	if (l->buffers)
+		return -1;
+
+	order = cbuf_order(len);
+	if (cbuf_size(order) > INT_MAX)
+		return -1;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -1;
+
+	r->base = cbuf_alloc(order);
+	if (!r->base) {
+		free(r);
+		return -1;
+	}
+
+	r->order = order;
+	r->size = cbuf_size(order);
+
+	/* keep a spare byte for the string terminator */
+	r->cap = r->size - s->string_data;
+
+	ustream_ring_reset(&r->buf);
+	ustream_add_buf(l, &r->buf);
+
+	return 0;
+}
+
+/* remove len bytes from the head of buf */
+static void ustream_buf_advance(struct ustream_buf_list *l, struct ustream_buf *buf, int len)
+{
+	struct ustream_ring *r;
+
+	buf->data += len;
+	if (!ustream_is_ring(l))
+		return;
+
+	r = container_of(buf, struct ustream_ring, buf);
+	if (buf->data >= r->base + r->size) {
+		buf->data -= r->size;
+		buf->tail -= r->size;
+	}
+	buf->end = buf->data + r->cap;
+}
+
 static bool ustream_can_alloc(struct ustream_buf_list *l)
 {
 	if (l->max_buffers <= 0)
@@ -57,14 +174,177 @@ static bool ustream_can_alloc(struct ustream_buf_list *l)
 	return (l->buffers < l->max_buffers);
 }
 
+/*
+ * Buffers from ustream_alloc_default are cached per thread in
+ * power of two size classes, so that streams filling and draining their
+ * buffers do not hit malloc on every burst. Each pooled buffer has room
+ * for its whole class plus the string terminator, so it can be reused
+ * for any buffer_len of that class.
+ */
+#define USTREAM_POOL_MIN_ORDER	8
+#define USTREAM_POOL_MAX_ORDER	16
+#define USTREAM_POOL_CLASSES	(USTREAM_POOL_MAX_ORDER - USTREAM_POOL_MIN_ORDER + 1)
+
+struct ustream_pool {
+	struct ustream_buf *free[USTREAM_POOL_CLASSES];
+	struct ustream_pool_stats stats;
+	bool registered;
+};
+
+size_t ustream_pool_max_bytes = 1024 * 1024;
+size_t ustream_pool_max_total = 16 * 1024 * 1024;
+
+static __thread struct ustream_pool pool;
+static size_t pool_total;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static bool pool_key_valid;
+
+/* a thread exiting with a filled cache returns it to malloc and pool_total */
+static void ustream_pool_thread_exit(void *arg)
+{
+	ustream_pool_trim(0);
+}
+
+static void ustream_pool_key_init(void)
+{
+	pool_key_valid = !pthread_key_create(&pool_key, ustream_pool_thread_exit);
+}
+
+/* only cache buffers once the exit handler of the thread is set up */
+static bool ustream_pool_register(void)
+{
+	if (pool.registered)
+		return true;
+
+	pthread_once(&pool_once, ustream_pool_key_init);
+	if (!pool_key_valid || pthread_setspecific(pool_key, &pool))
+		return false;
+
+	pool.registered = true;
+	return true;
+}
+
+static int ustream_pool_class(int len)
+{
+	int order;
+
+	if (len <= (1 << USTREAM_POOL_MIN_ORDER))
+		return 0;
+
+	order = 32 - __builtin_clz(len - 1);
+	if (order > USTREAM_POOL_MAX_ORDER)
+		return -1;
+
+	return order - USTREAM_POOL_MIN_ORDER;
+}
+
+static size_t ustream_pool_buf_size(int class)
+{
+	return sizeof(struct ustream_buf) + (1 << (class + USTREAM_POOL_MIN_ORDER)) + 1;
+}
+
+static struct ustream_buf *ustream_pool_get(int class)
+{
+	struct ustream_buf *buf = pool.free[class];
+	size_t size = ustream_pool_buf_size(class);
+
+	if (!buf) {
+		pool.stats.misses++;
+		return NULL;
+	}
+
+	pool.free[class] = buf->next;
+	pool.stats.hits++;
+	pool.stats.buffers--;
+	pool.stats.bytes -= size;
+	__atomic_sub_fetch(&pool_total, size, __ATOMIC_RELAXED);
+
+	return buf;
+}
+
+static void ustream_pool_put(struct ustream_buf *buf)
+{
+	int class = ustream_pool_class(buf->end - buf->head);
+	size_t size;
+
+	if (class < 0 || !ustream_pool_register())
+		goto release;
+
+	size = ustream_pool_buf_size(class);
+	if (pool.stats.bytes + size > ustream_pool_max_bytes)
+		goto release;
+
+	if (__atomic_add_fetch(&pool_total, size, __ATOMIC_RELAXED) > ustream_pool_max_total) {
+		__atomic_sub_fetch(&pool_total, size, __ATOMIC_RELAXED);
+		goto release;
+	}
+
+	buf->next = pool.free[class];
+	pool.free[class] = buf;
+	pool.stats.buffers++;
+	pool.stats.bytes += size;
+	return;
+
+release:
+	pool.stats.released++;
+	free(buf);
+}
+
+void ustream_pool_trim(size_t max_bytes)
+{
+	int class;
+
+	/* give back the largest buffers first */
+	for (class = USTREAM_POOL_CLASSES - 1; class >= 0; class--) {
+		size_t size = ustream_pool_buf_size(class);
+
+		while (pool.free[class] && pool.stats.bytes > max_bytes) {
+			struct ustream_buf *buf = pool.free[class];
+
+			pool.free[class] = buf->next;
+			pool.stats.buffers--;
+			pool.stats.bytes -= size;
+			pool.stats.trimmed++;
+			__atomic_sub_fetch(&pool_total, size, __ATOMIC_RELAXED);
+			free(buf);
+		}
+	}
+}
+
+void ustream_pool_get_stats(struct ustream_pool_stats *stats)
+{
+	*stats = pool.stats;
+	stats->total_bytes = __atomic_load_n(&pool_total, __ATOMIC_RELAXED);
+}
+
 static int ustream_alloc_default(struct ustream *s, struct ustream_buf_list *l)
 {
-	struct ustream_buf *buf;
+	struct ustream_buf *buf = NULL;
+	int class;
+	size_t size;
 
 	if (!ustream_can_alloc(l))
 		return -1;
 
-	buf = malloc(sizeof(*buf) + l->buffer_len + s->string_data);
+	class = ustream_pool_class(l->buffer_len);
+	if (class >= 0) {
+		buf = ustream_pool_get(class);
+		size = ustream_pool_buf_size(class);
+	} else {
+		size = sizeof(*buf) + l->buffer_len + s->string_data;
+	}
+
+	if (!buf)
+		buf = malloc(size);
+
+	/* under memory pressure, give back the cache and try again */
+	if (!buf && pool.stats.buffers) {
+		ustream_pool_trim(0);
+		buf = malloc(size);
+	}
+
 	if (!buf)
 		return -1;
 
@@ -74,6 +354,122 @@ static int ustream_alloc_default(struct ustream *s, struct ustream_buf_list *l)
 	return 0;
 }
 
+/*
+ * Adaptive buffer lists double buffer_len after USTREAM_ADAPT_GROW busy
+ * events in a row (a read filling a whole buffer, a write backlog of
+ * several buffers) and halve it again after USTREAM_ADAPT_SHRINK quiet
+ * ones. Growth is charged to a global budget, l->charged is the part of
+ * buffer_len a list owes it. An idle timer hands the growth back once a
+ * grown list sees no I/O at all.
+ */
+#define USTREAM_ADAPT_GROW	2
+#define USTREAM_ADAPT_SHRINK	8
+
+int ustream_adaptive_max_len = 64 * 1024;
+size_t ustream_adaptive_budget = 4 * 1024 * 1024;
+int ustream_adaptive_idle_msecs = 1000;
+
+static size_t adaptive_bytes;
+
+static bool ustream_is_adaptive(struct ustream_buf_list *l)
+{
+	return l->adaptive && l->alloc == ustream_alloc_default;
+}
+
+static void ustream_adapt(struct ustream *s, struct ustream_buf_list *l, bool busy)
+{
+	int len = l->buffer_len;
+	int new_len;
+
+	if (!ustream_is_adaptive(l))
+		return;
+
+	l->active = true;
+	if (busy) {
+		if (l->streak < 0)
+			l->streak = 0;
+
+		if (++l->streak < USTREAM_ADAPT_GROW || len >= ustream_adaptive_max_len)
+			return;
+
+		new_len = len * 2;
+		if (new_len > ustream_adaptive_max_len)
+			new_len = ustream_adaptive_max_len;
+
+		if (__atomic_add_fetch(&adaptive_bytes, new_len - len, __ATOMIC_RELAXED) >
+		    ustream_adaptive_budget) {
+			__atomic_sub_fetch(&adaptive_bytes, new_len - len, __ATOMIC_RELAXED);
+			return;
+		}
+
+		l->charged += new_len - len;
+		if (!s->adapt_timer.pending)
+			uloop_timeout_set(&s->adapt_timer, ustream_adaptive_idle_msecs);
+	} else {
+		if (l->streak > 0)
+			l->streak = 0;
+
+		if (--l->streak > -USTREAM_ADAPT_SHRINK || !l->charged)
+			return;
+
+		/* never below the size the list had before it grew */
+		new_len = len / 2;
+		if (new_len < len - l->charged)
+			new_len = len - l->charged;
+
+		l->charged -= len - new_len;
+		__atomic_sub_fetch(&adaptive_bytes, len - new_len, __ATOMIC_RELAXED);
+	}
+
+	l->buffer_len = new_len;
+	l->streak = 0;
+}
+
+/*
+ * drained buffers of a stale or grown size go back to the pool instead
+ * of being kept, so that quiet streams only hold buffers of the initial size
+ */
+static bool ustream_adapt_release(struct ustream_buf_list *l, struct ustream_buf *buf)
+{
+	int len;
+
+	/* only heap buffers hold their data at head, never a ring */
+	if (!ustream_is_adaptive(l) || ustream_is_ring(l))
+		return false;
+
+	len = buf->end - buf->head;
+	return len != l->buffer_len || len > l->base_len;
+}
+
+/* give the growth of a list back to the budget */
+static void ustream_adapt_reset(struct ustream_buf_list *l)
+{
+	if (!ustream_is_adaptive(l) || !l->charged)
+		return;
+
+	__atomic_sub_fetch(&adaptive_bytes, l->charged, __ATOMIC_RELAXED);
+	l->buffer_len -= l->charged;
+	l->charged = 0;
+	l->streak = 0;
+}
+
+static void ustream_release_buf(struct ustream_buf_list *l, struct ustream_buf *buf)
+{
+	struct ustream_ring *r;
+
+	if (ustream_is_ring(l)) {
+		r = container_of(buf, struct ustream_ring, buf);
+		cbuf_free(r->base, r->order);
+		free(r);
+		return;
+	}
+
+	if (l->alloc == ustream_alloc_default)
+		ustream_pool_put(buf);
+	else
+		free(buf);
+}
+
 static void ustream_free_buffers(struct ustream_buf_list *l)
 {
 	struct ustream_buf *buf = l->head;
@@ -81,12 +477,60 @@ static void ustream_free_buffers(struct ustream_buf_list *l)
 	while (buf) {
 		struct ustream_buf *next = buf->next;
 
-		free(buf);
+		ustream_release_buf(l, buf);
 		buf = next;
 	}
 	l->head = NULL;
 	l->tail = NULL;
 	l->data_tail = NULL;
+	l->buffers = 0;
+}
+
+/* returns true while the list still holds growth that may go idle */
+static bool ustream_adapt_idle(struct ustream_buf_list *l)
+{
+	if (!l->charged)
+		return false;
+
+	if (l->active) {
+		l->active = false;
+		return true;
+	}
+
+	ustream_adapt_reset(l);
+
+	/* empty buffers of the grown size are not worth keeping either */
+	if (!l->data_bytes)
+		ustream_free_buffers(l);
+
+	return false;
+}
+
+static void ustream_adapt_timer_cb(struct uloop_timeout *t)
+{
+	struct ustream *s = container_of(t, struct ustream, adapt_timer);
+	bool r = ustream_adapt_idle(&s->r);
+	bool w = ustream_adapt_idle(&s->w);
+
+	if (r || w)
+		uloop_timeout_set(t, ustream_adaptive_idle_msecs);
+}
+
+static void ustream_file_free(struct ustream *s, struct ustream_file *f)
+{
+	s->w_file_bytes -= f->len + f->copy_len - f->copy_ofs;
+	list_del(&f->list);
+	close(f->fd);
+	free(f->copy);
+	free(f);
+}
+
+static void ustream_free_files(struct ustream *s)
+{
+	struct ustream_file *f, *tmp;
+
+	list_for_each_entry_safe(f, tmp, &s->w_files, list)
+		ustream_file_free(s, f);
 }
 
 void ustream_free(struct ustream *s)
@@ -95,20 +539,37 @@ void ustream_free(struct ustream *s)
 		s->free(s);
 
 	uloop_timeout_cancel(&s->state_change);
+	uloop_defer_cancel(&s->state_defer);
+	uloop_timeout_cancel(&s->adapt_timer);
 	ustream_free_buffers(&s->r);
 	ustream_free_buffers(&s->w);
+	ustream_free_files(s);
+
+	ustream_adapt_reset(&s->r);
+	ustream_adapt_reset(&s->w);
 }
 
-static void ustream_state_change_cb(struct uloop_timeout *t)
+static void __ustream_state_change(struct ustream *s)
 {
-	struct ustream *s = container_of(t, struct ustream, state_change);
-
-	if (s->write_error)
+	if (s->write_error) {
 		ustream_free_buffers(&s->w);
+		ustream_free_files(s);
+	}
 	if (s->notify_state)
 		s->notify_state(s);
 }
 
+static void ustream_state_change_cb(struct uloop_defer *d)
+{
+	__ustream_state_change(container_of(d, struct ustream, state_defer));
+}
+
+/* for users that still schedule the state_change timeout themselves */
+static void ustream_state_change_timeout_cb(struct uloop_timeout *t)
+{
+	__ustream_state_change(container_of(t, struct ustream, state_change));
+}
+
 void ustream_init_defaults(struct ustream *s)
 {
 #define DEFAULT_SET(_f, _default)	\
@@ -130,7 +591,17 @@ void ustream_init_defaults(struct ustream *s)
 
 #undef DEFAULT_SET
 
-	s->state_change.cb = ustream_state_change_cb;
+	s->r.base_len = s->r.buffer_len;
+	s->r.streak = 0;
+	s->r.charged = 0;
+	s->w.base_len = s->w.buffer_len;
+	s->w.streak = 0;
+	s->w.charged = 0;
+
+	s->adapt_timer.cb = ustream_adapt_timer_cb;
+
+	s->state_change.cb = ustream_state_change_timeout_cb;
+	s->state_defer.cb = ustream_state_change_cb;
 	s->write_error = false;
 	s->eof = false;
 	s->eof_write_done = false;
@@ -141,6 +612,15 @@ void ustream_init_defaults(struct ustream *s)
 
 	s->w.buffers = 0;
 	s->w.data_bytes = 0;
+
+	INIT_LIST_HEAD(&s->w_files);
+	s->w_file_bytes = 0;
+}
+
+/* new data can only bypass the write buffers if nothing is queued */
+static bool ustream_write_queued(struct ustream *s)
+{
+	return s->w.data_bytes || !list_empty(&s->w_files);
 }
 
 static bool ustream_should_move(struct ustream_buf_list *l, struct ustream_buf *buf, int len)
@@ -148,6 +628,10 @@ static bool ustream_should_move(struct ustream_buf_list *l, struct ustream_buf *
 	int maxlen;
 	int offset;
 
+	/* the ring never needs to be squeezed */
+	if (ustream_is_ring(l))
+		return false;
+
 	/* nothing to squeeze */
 	if (buf->data == buf->head)
 		return false;
@@ -182,13 +666,16 @@ static void ustream_free_buf(struct ustream_buf_list *l, struct ustream_buf *buf
 	if (buf == l->tail)
 		l->tail = NULL;
 
-	if (--l->buffers >= l->min_buffers) {
-		free(buf);
+	if (--l->buffers >= l->min_buffers || ustream_adapt_release(l, buf)) {
+		ustream_release_buf(l, buf);
 		return;
 	}
 
 	/* recycle */
-	ustream_init_buf(buf, buf->end - buf->head);
+	if (ustream_is_ring(l))
+		ustream_ring_reset(buf);
+	else
+		ustream_init_buf(buf, buf->end - buf->head);
 	ustream_add_buf(l, buf);
 }
 
@@ -227,7 +714,7 @@ void ustream_consume(struct ustream *s, int len)
 		int buf_len = buf->tail - buf->data;
 
 		if (len < buf_len) {
-			buf->data += len;
+			ustream_buf_advance(&s->r, buf, len);
 			break;
 		}
 
@@ -321,6 +808,11 @@ void ustream_fill_read(struct ustream *s, int len)
 		buf = buf->next;
 	} while (len);
 
+	if (n >= s->r.buffer_len)
+		ustream_adapt(s, &s->r, true);
+	else if (n < s->r.buffer_len / 4)
+		ustream_adapt(s, &s->r, false);
+
 	if (s->notify_read)
 		s->notify_read(s, n);
 }
@@ -342,6 +834,59 @@ char *ustream_get_read_buf(struct ustream *s, int *buflen)
 	return data;
 }
 
+int ustream_get_read_iov(struct ustream *s, struct iovec *iov, int iovcnt)
+{
+	struct ustream_buf *buf;
+	int n = 0;
+
+	for (buf = s->r.head; buf && n < iovcnt; buf = buf->next) {
+		if (buf->tail > buf->data) {
+			iov[n].iov_base = buf->data;
+			iov[n].iov_len = buf->tail - buf->data;
+			n++;
+		}
+
+		if (buf == s->r.data_tail)
+			break;
+	}
+
+	return n;
+}
+
+char *ustream_peek(struct ustream *s, int offset, int len, char *dest)
+{
+	struct ustream_buf *buf;
+	int copied = 0;
+
+	if (offset < 0 || len <= 0 || len > s->r.data_bytes - offset)
+		return NULL;
+
+	for (buf = s->r.head; buf; buf = buf->next) {
+		int buf_len = buf->tail - buf->data;
+
+		if (offset >= buf_len) {
+			offset -= buf_len;
+			continue;
+		}
+
+		/* the span is within a single buffer, no need to copy */
+		if (!copied && offset + len <= buf_len)
+			return buf->data + offset;
+
+		if (buf_len - offset > len - copied)
+			buf_len = len - copied + offset;
+
+		memcpy(dest + copied, buf->data + offset, buf_len - offset);
+		copied += buf_len - offset;
+		offset = 0;
+
+		if (copied == len)
+			break;
+	}
+
+	return dest;
+}
+
 int ustream_read(struct ustream *s, char *buf, int buflen)
 {
 	char *chunk;
@@ -369,18 +914,75 @@ static void ustream_write_error(struct ustream *s)
 	s->write_error = true;
 }
 
-bool ustream_write_pending(struct ustream *s)
+/* flush up to limit bytes of the write buffers with as few writev calls as possible */
+static int ustream_writev_pending(struct ustream *s, int limit)
+{
+	struct iovec iov[USTREAM_IOV_MAX];
+	struct ustream_buf *buf, *next;
+	int wr = 0, n, len, ret, maxlen;
+	size_t total;
+
+	while (s->w.data_bytes && wr < limit) {
+		n = 0;
+		total = 0;
+		for (buf = s->w.head; buf && n < USTREAM_IOV_MAX; buf = buf->next) {
+			if (buf->tail == buf->data)
+				continue;
+
+			iov[n].iov_base = buf->data;
+			iov[n].iov_len = buf->tail - buf->data;
+			if (iov[n].iov_len > limit - wr - total)
+				iov[n].iov_len = limit - wr - total;
+			total += iov[n].iov_len;
+			n++;
+
+			if (total == (size_t) (limit - wr))
+				break;
+		}
+
+		if (!n)
+			break;
+
+		ret = len = s->writev(s, iov, n);
+		if (len < 0) {
+			ustream_write_error(s);
+			break;
+		}
+
+		wr += len;
+		s->w.data_bytes -= len;
+		for (buf = s->w.head; buf && len; buf = next) {
+			next = buf->next;
+			maxlen = buf->tail - buf->data;
+			if (len < maxlen) {
+				ustream_buf_advance(&s->w, buf, len);
+				break;
+			}
+
+			len -= maxlen;
+			ustream_free_buf(&s->w, buf);
+		}
+
+		/* stop when the kernel did not take everything */
+		if ((size_t) ret < total)
+			break;
+	}
+
+	return wr;
+}
+
+static int ustream_write_pending_bufs(struct ustream *s, int limit)
 {
 	struct ustream_buf *buf = s->w.head;
 	int wr = 0, len;
 
-	if (s->write_error)
-		return false;
-
-	while (buf && s->w.data_bytes) {
+	while (buf && s->w.data_bytes && wr < limit) {
 		struct ustream_buf *next = buf->next;
 		int maxlen = buf->tail - buf->data;
 
+		if (maxlen > limit - wr)
+			maxlen = limit - wr;
+
 		len = s->write(s, buf->data, maxlen, !!buf->next);
 		if (len < 0) {
 			ustream_write_error(s);
@@ -392,22 +994,216 @@ bool ustream_write_pending(struct ustream *s)
 
 		wr += len;
 		s->w.data_bytes -= len;
-		if (len < maxlen) {
-			buf->data += len;
+		ustream_buf_advance(&s->w, buf, len);
+		if (buf->data < buf->tail)
 			break;
-		}
 
 		ustream_free_buf(&s->w, buf);
 		buf = next;
 	}
 
+	return wr;
+}
+
+static int ustream_write_bufs(struct ustream *s, int limit)
+{
+	if (s->writev)
+		return ustream_writev_pending(s, limit);
+	else
+		return ustream_write_pending_bufs(s, limit);
+}
+
+/* fallback for streams without sendfile support */
+static int ustream_file_copy(struct ustream *s, struct ustream_file *f)
+{
+	int wr = 0, len;
+	ssize_t ret;
+
+	while (f->len || f->copy_ofs < f->copy_len) {
+		if (f->copy_ofs == f->copy_len) {
+			len = f->len < USTREAM_COPY_BUFLEN ? f->len : USTREAM_COPY_BUFLEN;
+			if (f->off >= 0)
+				ret = pread(f->fd, f->copy, len, f->off);
+			else
+				ret = read(f->fd, f->copy, len);
+			if (ret <= 0)
+				return ret < 0 && errno == EAGAIN ? wr : -1;
+
+			if (f->off >= 0)
+				f->off += ret;
+			f->len -= ret;
+			f->copy_ofs = 0;
+			f->copy_len = ret;
+		}
+
+		len = s->write(s, f->copy + f->copy_ofs, f->copy_len - f->copy_ofs,
+			       f->len > 0);
+		if (len <= 0)
+			return len < 0 ? -1 : wr;
+
+		f->copy_ofs += len;
+		s->w_file_bytes -= len;
+		wr += len;
+	}
+
+	return wr;
+}
+
+static int ustream_file_send(struct ustream *s, struct ustream_file *f)
+{
+	int wr = 0, len;
+
+	while (f->len && !f->copy) {
+		len = f->len < INT_MAX ? f->len : INT_MAX;
+		len = s->sendfile(s, f->fd, f->off >= 0 ? &f->off : NULL, len);
+		if (len < 0) {
+			if (errno != EINVAL && errno != ENOSYS && errno != ENOTSUP)
+				return -1;
+			break;
+		}
+
+		if (!len)
+			return wr;
+
+		f->len -= len;
+		s->w_file_bytes -= len;
+		wr += len;
+	}
+
+	if (!f->len)
+		return wr;
+
+	/* the kernel cannot transfer between these fds, copy the data */
+	if (!f->copy) {
+		f->copy = malloc(USTREAM_COPY_BUFLEN);
+		if (!f->copy)
+			return -1;
+	}
+
+	len = ustream_file_copy(s, f);
+	if (len < 0)
+		return -1;
+
+	return wr + len;
+}
+
+/* write buffered data and queued files in order, returns the bytes written */
+static int ustream_write_queue(struct ustream *s)
+{
+	struct ustream_file *f;
+	int wr = 0, len, limit;
+
+	while (!s->write_error) {
+		f = list_empty(&s->w_files) ? NULL :
+			list_first_entry(&s->w_files, struct ustream_file, list);
+
+		limit = f ? f->before : INT_MAX;
+		if (limit && s->w.data_bytes) {
+			len = ustream_write_bufs(s, limit);
+			wr += len;
+			if (f)
+				f->before -= len;
+		}
+
+		if (!f || f->before)
+			break;
+
+		if (s->sendfile && !f->copy)
+			len = ustream_file_send(s, f);
+		else if (f->copy || (f->copy = malloc(USTREAM_COPY_BUFLEN)))
+			len = ustream_file_copy(s, f);
+		else
+			len = -1;
+
+		if (len < 0) {
+			ustream_write_error(s);
+			break;
+		}
+
+		wr += len;
+		if (f->len || f->copy_ofs < f->copy_len)
+			break;
+
+		ustream_file_free(s, f);
+	}
+
+	return wr;
+}
+
+bool ustream_write_pending(struct ustream *s)
+{
+	int wr;
+
+	if (s->write_error)
+		return false;
+
+	wr = ustream_write_queue(s);
+
 	if (s->notify_write)
 		s->notify_write(s, wr);
 
-	if (s->eof && wr && !s->w.data_bytes)
+	if (s->eof && wr && !ustream_write_queued(s))
 		ustream_state_change(s);
 
-	return !s->w.data_bytes;
+	return !ustream_write_queued(s);
+}
+
+int ustream_sendfile(struct ustream *s, int fd, off_t off, size_t len)
+{
+	struct ustream_file *f, *cur;
+	struct stat st = {};
+	int before;
+
+	if (s->write_error)
+		return -1;
+
+	if (!len)
+		return 0;
+
+	before = s->w.data_bytes;
+	list_for_each_entry(cur, &s->w_files, list)
+		before -= cur->before;
+
+	if (off < 0 && fstat(fd, &st))
+		return -1;
+
+	/* consecutive chunks of the same pipe extend the last entry */
+	if (off < 0 && !before && !list_empty(&s->w_files)) {
+		cur = list_last_entry(&s->w_files, struct ustream_file, list);
+		if (cur->off < 0 && cur->dev == st.st_dev && cur->ino == st.st_ino) {
+			cur->len += len;
+			s->w_file_bytes += len;
+			return 0;
+		}
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return -1;
+
+	f->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (f->fd < 0) {
+		free(f);
+		return -1;
+	}
+
+	f->off = off;
+	f->len = len;
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->before = before;
+
+	list_add_tail(&f->list, &s->w_files);
+	s->w_file_bytes += len;
+
+	if (f->before || f->list.prev != &s->w_files)
+		return 0;
+
+	/* nothing queued in front of it, start sending right away */
+	if (ustream_write_queue(s) < 0 || s->write_error)
+		return -1;
+
+	return 0;
 }
 
 static int ustream_write_buffered(struct ustream *s, const char *data, int len, int wr)
@@ -416,6 +1212,10 @@ static int ustream_write_buffered(struct ustream *s, const char *data, int len,
 	struct ustream_buf *buf;
 	int maxlen;
 
+	/* a backlog of several buffers means the peer cannot keep up */
+	if (l->data_bytes + len > 4 * l->buffer_len)
+		ustream_adapt(s, l, true);
+
 	while (len) {
 		if (!ustream_prepare_buf(s, &s->w, len))
 			break;
@@ -439,16 +1239,17 @@ static int ustream_write_buffered(struct ustream *s, const char *data, int len,
 
 int ustream_write(struct ustream *s, const char *data, int len, bool more)
 {
-	struct ustream_buf_list *l = &s->w;
 	int wr = 0;
 
 	if (s->write_error)
 		return 0;
 
-	if (!l->data_bytes) {
+	if (!ustream_write_queued(s)) {
 		wr = s->write(s, data, len, more);
-		if (wr == len)
+		if (wr == len) {
+			ustream_adapt(s, &s->w, false);
 			return wr;
+		}
 
 		if (wr < 0) {
 			ustream_write_error(s);
@@ -474,7 +1275,7 @@ int ustream_vprintf(struct ustream *s, const char *format, va_list arg)
 	if (s->write_error)
 		return 0;
 
-	if (!l->data_bytes) {
+	if (!ustream_write_queued(s)) {
 		buf = alloca(MAX_STACK_BUFLEN);
 		va_copy(arg2, arg);
 		maxlen = vsnprintf(buf, MAX_STACK_BUFLEN, format, arg2);
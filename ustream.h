@@ -20,6 +20,9 @@
 #define __USTREAM_H
 
 #include <stdarg.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "uloop.h"
 
 struct ustream;
@@ -43,12 +46,26 @@ struct ustream_buf_list {
 	int max_buffers;
 	int buffer_len;
 
+	/*
+	 * adaptive: (optional) grow buffer_len while the stream moves bulk
+	 * data and shrink it back when it goes quiet. Drained buffers larger
+	 * than the initial size are released instead of being kept around.
+	 * Only used with the default allocator.
+	 */
+	bool adaptive;
+	bool active;
+	int base_len;
+	int streak;
+	int charged;
+
 	int buffers;
 };
 
 struct ustream {
 	struct ustream_buf_list r, w;
 	struct uloop_timeout state_change;
+	struct uloop_defer state_defer;
+	struct uloop_timeout adapt_timer;
 	struct ustream *next;
 
 	/*
@@ -87,6 +104,24 @@ struct ustream {
 	 */
 	int (*write)(struct ustream *s, const char *buf, int len, bool more);
 
+	/*
+	 * writev: (optional)
+	 * defined by ustream implementation, like write but for several
+	 * buffers at once. used to flush the write buffers with one call.
+	 * returns the number of bytes accepted, or -1 on link error
+	 */
+	int (*writev)(struct ustream *s, const struct iovec *iov, int iovcnt);
+
+	/*
+	 * sendfile: (optional)
+	 * defined by ustream implementation, writes up to len bytes from fd
+	 * without copying them through user space, starting at *off (which
+	 * is updated) or at the current position of fd if off is NULL.
+	 * returns the number of bytes accepted, or -1 with errno set. EINVAL,
+	 * ENOSYS or ENOTSUP make the core fall back to copying the data.
+	 */
+	int (*sendfile)(struct ustream *s, int fd, off_t *off, int len);
+
 	/*
 	 * free: (optional)
 	 * defined by ustream implementation, tears down the ustream and frees data
@@ -117,13 +152,30 @@ struct ustream {
 	bool eof, eof_write_done;
 
 	enum read_blocked_reason read_blocked;
+
+	/* file ranges queued by ustream_sendfile */
+	struct list_head w_files;
+	size_t w_file_bytes;
 };
 
 struct ustream_fd {
 	struct ustream stream;
 	struct uloop_fd fd;
+
+	struct ustream_fd_passing *fdp;
 };
 
+#define USTREAM_FD_MAX_FDS	16
+
+/*
+ * called with fds received over a unix socket, before the data they were
+ * sent with is added to the read buffer. The callee owns the fds, which
+ * are close-on-exec. If the peer sent more than USTREAM_FD_MAX_FDS fds
+ * with one message, the rest is lost and cb is called again with fds
+ * NULL and n_fds -1.
+ */
+typedef void (*ustream_fd_notify_fds)(struct ustream_fd *s, int *fds, int n_fds);
+
 struct ustream_buf {
 	struct ustream_buf *next;
 
@@ -137,6 +189,51 @@ struct ustream_buf {
 /* ustream_fd_init: create a file descriptor ustream (uses uloop) */
 void ustream_fd_init(struct ustream_fd *s, int fd);
 
+/*
+ * ustream_fd_set_fd_passing: send and receive fds (SCM_RIGHTS) on a unix
+ * socket stream. Call after ustream_fd_init. Received fds are closed if
+ * cb is NULL.
+ */
+int ustream_fd_set_fd_passing(struct ustream_fd *s, ustream_fd_notify_fds cb);
+
+/*
+ * ustream_fd_write_fds: write data along with up to USTREAM_FD_MAX_FDS fds.
+ * The fds are duplicated, the caller keeps its own copies. They are sent
+ * with the first byte of the data, in order with anything still in the
+ * write buffer.
+ */
+int ustream_fd_write_fds(struct ustream_fd *s, const char *buf, int len,
+			 const int *fds, int n_fds);
+
+/*
+ * ustream_splice: forward everything read from a ustream_fd to another
+ * ustream without copying it through user space. Data moves from the
+ * source fd into a pipe and is queued on dst with ustream_sendfile(), so
+ * it stays ordered with other writes to dst (Linux only).
+ *
+ * Reading on src is blocked while the splice is active. Data that src
+ * has already buffered is written to dst first. notify_eof is called
+ * once the source hits EOF (or error is set), dst may still have queued
+ * data at that point.
+ */
+struct ustream_splice {
+	struct uloop_fd src_fd;
+	struct uloop_fd pipe_fd;
+	int pipe_r, pipe_size;
+
+	struct ustream_fd *src;
+	struct ustream *dst;
+
+	void (*notify_eof)(struct ustream_splice *sp);
+
+	uint64_t bytes;
+	bool eof, error;
+};
+
+int ustream_splice_init(struct ustream_splice *sp, struct ustream_fd *src,
+			struct ustream *dst);
+void ustream_splice_free(struct ustream_splice *sp);
+
 /* ustream_free: free all buffers and data associated with a ustream */
 void ustream_free(struct ustream *s);
 
@@ -151,11 +248,84 @@ int ustream_read(struct ustream *s, char *buf, int buflen);
 /* ustream_write: add data to the write buffer */
 int ustream_write(struct ustream *s, const char *buf, int len, bool more);
 int ustream_printf(struct ustream *s, const char *format, ...);
+
+/*
+ * ustream_sendfile: write len bytes of fd starting at off (or at the
+ * current position if off is negative, e.g. for pipes), in order with
+ * the buffered data. The stream implementation moves the data in the
+ * kernel if it supports it. fd is duplicated, the caller keeps its own.
+ * Bytes sent after this call returns are reported through notify_write.
+ */
+int ustream_sendfile(struct ustream *s, int fd, off_t off, size_t len);
 int ustream_vprintf(struct ustream *s, const char *format, va_list arg);
 
 /* ustream_get_read_buf: get a pointer to the next read buffer data */
 char *ustream_get_read_buf(struct ustream *s, int *buflen);
 
+/*
+ * ustream_get_read_iov: fill iov with up to iovcnt chunks of pending read
+ * data, in order. Returns the number of entries filled. The data stays in
+ * the read buffer until it is passed to ustream_consume.
+ */
+int ustream_get_read_iov(struct ustream *s, struct iovec *iov, int iovcnt);
+
+/*
+ * ustream_peek: get len bytes of pending read data starting at offset
+ * without consuming them. Returns a pointer into the read buffer if the
+ * span is contiguous, otherwise the data is copied to dest (which must
+ * hold len bytes) and dest is returned. Returns NULL if less data is
+ * pending.
+ */
+char *ustream_peek(struct ustream *s, int offset, int len, char *dest);
+
+/*
+ * ustream_alloc_ring: buffer allocator that keeps a buffer list in a
+ * single mirrored ring of at least buffer_len bytes (see cbuf_alloc).
+ * Set it as r.alloc and/or w.alloc before initializing the stream; all
+ * pending data is then always returned as one contiguous block and is
+ * never moved around in memory.
+ */
+int ustream_alloc_ring(struct ustream *s, struct ustream_buf_list *l);
+
+/*
+ * Buffers of the default allocator are not freed right away but kept in
+ * a cache shared by all streams of a thread, in power of two size
+ * classes up to 64k. The cache of a thread holds at most
+ * ustream_pool_max_bytes, all threads together at most
+ * ustream_pool_max_total; buffers beyond that are freed. A thread's
+ * cache is freed when the thread exits.
+ */
+struct ustream_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t released;	/* not cached because of the limits */
+	uint64_t trimmed;	/* given back by ustream_pool_trim */
+	size_t bytes;
+	unsigned int buffers;
+	size_t total_bytes;	/* cached by all threads */
+};
+
+extern size_t ustream_pool_max_bytes;
+extern size_t ustream_pool_max_total;
+
+/*
+ * Limits for adaptive buffer lists: the largest buffer_len a list grows
+ * to, and how many bytes all lists together may grow beyond their
+ * initial buffer_len. A grown list that sees no I/O for
+ * ustream_adaptive_idle_msecs drops back to its initial buffer_len and
+ * frees its buffers if they are empty.
+ */
+extern int ustream_adaptive_max_len;
+extern size_t ustream_adaptive_budget;
+extern int ustream_adaptive_idle_msecs;
+
+/*
+ * ustream_pool_trim: free cached buffers of the current thread until at
+ * most max_bytes are left, e.g. under memory pressure.
+ */
+void ustream_pool_trim(size_t max_bytes);
+void ustream_pool_get_stats(struct ustream_pool_stats *stats);
+
 /*
  * ustream_set_read_blocked: set read blocked state
  *
@@ -171,12 +341,22 @@ static inline bool ustream_read_blocked(struct ustream *s)
 static inline int ustream_pending_data(struct ustream *s, bool write)
 {
 	struct ustream_buf_list *b = write ? &s->w : &s->r;
+
+	if (write && s->w_file_bytes)
+		return s->w_file_bytes > (size_t) (INT_MAX - b->data_bytes) ?
+		       INT_MAX : b->data_bytes + (int) s->w_file_bytes;
+
 	return b->data_bytes;
 }
 
 static inline bool ustream_read_buf_full(struct ustream *s)
 {
 	struct ustream_buf *buf = s->r.data_tail;
+
+	/* a ring never has free space in front of the data */
+	if (buf && s->r.alloc == ustream_alloc_ring)
+		return buf->tail == buf->end;
+
 	return buf && buf->data == buf->head && buf->tail == buf->end &&
 	       s->r.buffers == s->r.max_buffers;
 }
@@ -205,7 +385,7 @@ bool ustream_write_pending(struct ustream *s);
 
 static inline void ustream_state_change(struct ustream *s)
 {
-	uloop_timeout_set(&s->state_change, 0);
+	uloop_defer_add(&s->state_defer);
 }
 
 static inline bool ustream_poll(struct ustream *s)
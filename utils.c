@@ -16,7 +16,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -111,20 +114,39 @@ out:
 
 #endif
 
-void *cbuf_alloc(unsigned int order)
+static int cbuf_open(void)
 {
 	char path[] = "/tmp/cbuf-XXXXXX";
+	int fd;
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	fd = memfd_create("cbuf", MFD_CLOEXEC);
+	if (fd >= 0 || errno != ENOSYS)
+		return fd;
+#endif
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+
+	if (unlink(path)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void *cbuf_alloc(unsigned int order)
+{
 	unsigned long size = cbuf_size(order);
 	void *ret = NULL;
 	int fd;
 
-	fd = mkstemp(path);
+	fd = cbuf_open();
 	if (fd < 0)
 		return NULL;
 
-	if (unlink(path))
-		goto close;
-
 	if (ftruncate(fd, cbuf_size(order)))
 		goto close;
 